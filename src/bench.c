@@ -0,0 +1,564 @@
+/************************************************************************/
+/* PROGRAM NAME: bench.c (load generator for server.c)					*/
+/*																		*/
+/* Opens thousands of simulated clients against a running server,		*/
+/* does the name handshake for each, puts them in rooms of a given		*/
+/* size and has every client send at a steady rate. Each message		*/
+/* carries its send time, so every copy the other room members get		*/
+/* gives one end-to-end fanout latency sample.							*/
+/*																		*/
+/* Latencies go into an HDR style histogram (log buckets, each split	*/
+/* into HIST_SUB linear steps, so every sample is kept to within 1%).	*/
+/* The report has the throughput, lost frames and p50/p99/p999.		*/
+/*																		*/
+/* The clients are spread over a few threads, each with its own epoll	*/
+/* loop. Raise the open file limit (ulimit -n) for very large runs.		*/
+/*																		*/
+/* COMPILE: gcc bench.c -o bench -pthread								*/
+/* TO RUN: ./bench [-h host] [-p port] [-n clients] [-t threads]		*/
+/*				   [-r room size] [-m msgs/s per client] [-l bytes]		*/
+/*				   [-d seconds]											*/
+/*																		*/
+/************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "protocol.h"
+
+#define SERVER_PORT 7777
+#define BENCH_CLIENTS 1000 //default simulated clients
+#define BENCH_THREADS 4 //default event loop threads
+#define ROOM_SIZE 50 //default clients per room
+#define SEND_RATE 1.0 //default messages per second per client
+#define PAYLOAD_SIZE 64 //default payload bytes, timestamp included
+#define PAYLOAD_MAX 3968 //the server cuts lines longer than this
+#define DURATION 10 //default seconds of sending
+#define DRAIN_SECONDS 2 //wait for frames still in flight after the last send
+#define READY_TIMEOUT 60 //give up if the handshakes take longer than this
+#define MAX_THREADS 64
+#define MAX_EVENTS 256
+#define OUT_BUFFER (2 * (FRAME_HEADER_MAX + PAYLOAD_MAX)) //frames waiting for a full socket
+#define TICK_MS 1 //send schedule resolution
+#define BURST_LIMIT 4 //most catch-up sends per client per tick
+#define HIST_SUB_BITS 7 //128 linear steps per power of two
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 - HIST_SUB_BITS + 1)
+
+//what the whole run is doing, set by main() and polled by the workers
+enum bench_phase
+{
+	PHASE_CONNECT,	//connecting and waiting for every handshake
+	PHASE_RUN,	//sending on schedule
+	PHASE_DRAIN,	//no more sends, still counting arrivals
+	PHASE_DONE
+};
+
+//command line settings
+struct bench_config
+{
+	const char *host;
+	int port;
+	size_t clients;
+	int threads;
+	size_t room_size; //0 keeps everyone in the lobby
+	double rate; //messages per second per client
+	size_t payload;
+	int duration; //seconds
+} config = { "127.0.0.1", SERVER_PORT, BENCH_CLIENTS, BENCH_THREADS, ROOM_SIZE, SEND_RATE, PAYLOAD_SIZE, DURATION };
+
+//HDR style histogram: bucket b covers [2^(b+HIST_SUB_BITS-1), 2^(b+HIST_SUB_BITS))
+//in HIST_SUB/2 equal steps, bucket 0 holds the small values one by one
+struct histogram
+{
+	uint64_t m_count;
+	uint64_t m_min;
+	uint64_t m_max;
+	uint64_t m_counts[HIST_BUCKETS][HIST_SUB];
+};
+
+//one simulated client
+typedef struct bots
+{
+	int m_fd;
+	size_t m_index;
+	int m_ready; //joined its room
+	char m_room[32]; //room it should end up in
+	size_t m_peers; //other members of its room, the copies each send should produce
+	uint64_t m_next_send; //CLOCK_MONOTONIC ns
+	struct frame_reader m_in;
+	unsigned char m_out[OUT_BUFFER]; //frames the socket did not take yet
+	size_t m_out_len;
+} bot;
+
+//one event loop thread and the clients it drives
+typedef struct workers
+{
+	pthread_t m_thread;
+	int m_epfd;
+	bot *m_bots;
+	size_t m_first; //index of m_bots[0] among all clients
+	size_t m_count;
+	unsigned long m_sent; //messages sent during PHASE_RUN
+	unsigned long m_stalled; //sends skipped because the socket was full
+	unsigned long m_expected; //copies the sends should produce
+	unsigned long m_received; //copies that came back
+	unsigned long m_closed; //clients the server hung up on
+	struct histogram m_latency; //ns
+} worker;
+
+worker *workers;
+atomic_int phase = PHASE_CONNECT;
+atomic_size_t ready_count;
+uint64_t start_ns; //when PHASE_RUN began, sends before it are not measured
+
+//list of functions used in bench.c
+void parse_options(int argc, char * argv[]);
+void usage(const char * prog);
+void *worker_main(void * arg);
+void connect_bot(worker * w, bot * b, struct sockaddr_in * addr);
+int send_frame(bot * b, int type, const char * text, size_t len);
+void flush_bot(bot * b);
+void send_due(worker * w, uint64_t now);
+void on_bot_readable(worker * w, bot * b);
+void on_bot_frame(worker * w, bot * b, struct frame * f);
+uint64_t now_ns();
+void hist_record(struct histogram * h, uint64_t v);
+void hist_merge(struct histogram * into, struct histogram * from);
+uint64_t hist_percentile(struct histogram * h, double pct);
+void raise_fd_limit();
+
+int main(int argc, char * argv[])
+{
+	struct histogram *total;
+	unsigned long sent = 0, stalled = 0, expected = 0, received = 0, closed = 0;
+	uint64_t began, handshake;
+	size_t per;
+	int i;
+	parse_options(argc, argv);
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
+	if ((workers = calloc(config.threads, sizeof(worker))) == NULL || (total = calloc(1, sizeof(struct histogram))) == NULL)
+	{
+		perror("bench: out of memory");
+		exit(1);
+	}
+	printf(">>Bench: %zu clients on %d threads, rooms of %zu, %.2f msg/s per client, %zu byte payloads, %d s\n",
+		config.clients, config.threads, config.room_size, config.rate, config.payload, config.duration);
+	began = now_ns();
+	per = (config.clients + config.threads - 1) / config.threads;
+	for (i = 0; i < config.threads; i++)
+	{
+		workers[i].m_first = i * per < config.clients ? i * per : config.clients;
+		workers[i].m_count = workers[i].m_first + per < config.clients ? per : config.clients - workers[i].m_first;
+		if (pthread_create(&workers[i].m_thread, NULL, worker_main, &workers[i]) != 0)
+		{
+			perror("bench: creating thread failed");
+			exit(1);
+		}
+	}
+	//every client has to be in its room before anyone sends
+	while (atomic_load(&ready_count) < config.clients)
+	{
+		if (now_ns() - began > (uint64_t)READY_TIMEOUT * 1000000000u)
+		{
+			fprintf(stderr, "bench: only %zu of %zu clients finished the handshake\n", atomic_load(&ready_count), config.clients);
+			exit(1);
+		}
+		usleep(10000);
+	}
+	handshake = now_ns() - began;
+	printf(">>Handshake: %zu clients ready in %.2f s\n", config.clients, handshake / 1e9);
+	start_ns = now_ns();
+	atomic_store(&phase, PHASE_RUN);
+	sleep(config.duration);
+	atomic_store(&phase, PHASE_DRAIN);
+	sleep(DRAIN_SECONDS);
+	atomic_store(&phase, PHASE_DONE);
+	for (i = 0; i < config.threads; i++)
+	{
+		pthread_join(workers[i].m_thread, NULL);
+		sent += workers[i].m_sent;
+		stalled += workers[i].m_stalled;
+		expected += workers[i].m_expected;
+		received += workers[i].m_received;
+		closed += workers[i].m_closed;
+		hist_merge(total, &workers[i].m_latency);
+	}
+	printf(">>Sent: %lu messages (%.1f/s), %lu skipped on a full socket\n",
+		sent, sent / (double)config.duration, stalled);
+	printf(">>Delivered: %lu of %lu expected frames (%.1f/s), %lu lost, %lu clients disconnected\n",
+		received, expected, received / (double)config.duration, expected > received ? expected - received : 0, closed);
+	if (total->m_count > 0)
+	{
+		printf(">>Fanout latency: min %.1f us, p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+			total->m_min / 1000.0, hist_percentile(total, 50) / 1000.0, hist_percentile(total, 99) / 1000.0,
+			hist_percentile(total, 99.9) / 1000.0, total->m_max / 1000.0);
+	}
+	return (0);
+}
+//reads the command line into config
+void parse_options(int argc, char * argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:n:t:r:m:l:d:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h':
+			config.host = optarg;
+			break;
+		case 'p':
+			config.port = atoi(optarg);
+			break;
+		case 'n':
+			config.clients = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			config.threads = atoi(optarg);
+			break;
+		case 'r':
+			config.room_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			config.rate = atof(optarg);
+			break;
+		case 'l':
+			config.payload = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			config.duration = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (config.threads > MAX_THREADS)
+		config.threads = MAX_THREADS;
+	if ((size_t)config.threads > config.clients)
+		config.threads = config.clients;
+	//the payload has to hold the timestamp: T + 20 digits + a space
+	if (config.clients < 1 || config.threads < 1 || config.rate <= 0 || config.payload < 24
+		|| config.payload > PAYLOAD_MAX || config.duration < 1 || config.port < 1)
+		usage(argv[0]);
+}
+void usage(const char * prog)
+{
+	printf("Usage: %s [-h host] [-p port] [-n clients] [-t threads] [-r room size, 0 = lobby]\n"
+		"       [-m msgs/s per client] [-l payload bytes, 24-%d] [-d seconds]\n", prog, PAYLOAD_MAX);
+	exit(1);
+}
+//connects this thread's clients, then runs their sockets until PHASE_DONE
+void *worker_main(void * arg)
+{
+	worker *w = arg;
+	struct sockaddr_in addr = { AF_INET, htons(config.port) };
+	struct epoll_event events[MAX_EVENTS];
+	struct hostent *hp;
+	size_t i;
+	int n, p;
+	if ((hp = gethostbyname(config.host)) == NULL)
+	{
+		fprintf(stderr, "bench: %s unknown host\n", config.host);
+		exit(1);
+	}
+	memcpy(&addr.sin_addr, hp->h_addr_list[0], hp->h_length);
+	if ((w->m_epfd = epoll_create1(0)) == -1 || (w->m_bots = calloc(w->m_count, sizeof(bot))) == NULL)
+	{
+		perror("bench: worker setup failed");
+		exit(1);
+	}
+	w->m_latency.m_min = UINT64_MAX;
+	for (i = 0; i < w->m_count; i++)
+	{
+		w->m_bots[i].m_index = w->m_first + i;
+		connect_bot(w, &w->m_bots[i], &addr);
+	}
+	while ((p = atomic_load(&phase)) != PHASE_DONE)
+	{
+		n = epoll_wait(w->m_epfd, events, MAX_EVENTS, TICK_MS);
+		if (n == -1 && errno != EINTR)
+		{
+			perror("bench: epoll_wait failed");
+			exit(1);
+		}
+		for (i = 0; n > 0 && i < (size_t)n; i++)
+		{
+			bot *b = events[i].data.ptr;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				on_bot_readable(w, b);
+			if (b->m_fd != -1 && (events[i].events & EPOLLOUT))
+				flush_bot(b);
+		}
+		if (p == PHASE_RUN)
+			send_due(w, now_ns());
+	}
+	for (i = 0; i < w->m_count; i++)
+	{
+		if (w->m_bots[i].m_fd != -1)
+			close(w->m_bots[i].m_fd);
+		frame_reader_free(&w->m_bots[i].m_in);
+	}
+	return NULL;
+}
+//opens one client, sends its name and the /join for its room
+//a plain blocking connect, the server accepts as fast as we can connect
+void connect_bot(worker * w, bot * b, struct sockaddr_in * addr)
+{
+	struct epoll_event ev;
+	char line[64];
+	size_t room = config.room_size ? b->m_index / config.room_size : 0;
+	size_t members;
+	int one = 1;
+	if ((b->m_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	{
+		perror("bench: socket failed");
+		exit(1);
+	}
+	if (connect(b->m_fd, (struct sockaddr*)addr, sizeof(*addr)) == -1)
+	{
+		perror("bench: connection failed");
+		exit(1);
+	}
+	//latency is what we measure, do not let Nagle hold our small frames back
+	setsockopt(b->m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (frame_reader_init(&b->m_in) == -1)
+	{
+		perror("bench: out of memory");
+		exit(1);
+	}
+	if (config.room_size == 0 || config.room_size >= config.clients)
+	{
+		strcpy(b->m_room, "lobby");
+		members = config.clients;
+	}
+	else
+	{
+		snprintf(b->m_room, sizeof(b->m_room), "bench%zu", room);
+		//the last room gets whatever is left over
+		members = config.clients - room * config.room_size < config.room_size ? config.clients - room * config.room_size : config.room_size;
+	}
+	b->m_peers = members - 1;
+	snprintf(line, sizeof(line), "bench%zu", b->m_index);
+	send_frame(b, FRAME_NAME, line, strlen(line));
+	if (strcmp(b->m_room, "lobby") != 0)
+	{
+		snprintf(line, sizeof(line), "/join %s", b->m_room);
+		send_frame(b, FRAME_TEXT, line, strlen(line));
+	}
+	fcntl(b->m_fd, F_SETFL, fcntl(b->m_fd, F_GETFL, 0) | O_NONBLOCK);
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = b;
+	if (epoll_ctl(w->m_epfd, EPOLL_CTL_ADD, b->m_fd, &ev) == -1)
+	{
+		perror("bench: epoll_ctl failed");
+		exit(1);
+	}
+}
+//queues one frame behind whatever is still unsent and tries to write it
+//-1 if the socket is so far behind that the frame does not fit
+int send_frame(bot * b, int type, const char * text, size_t len)
+{
+	size_t n;
+	if ((n = frame_encode(b->m_out + b->m_out_len, OUT_BUFFER - b->m_out_len, type, text, len)) == 0)
+		return -1;
+	b->m_out_len += n;
+	flush_bot(b);
+	return 0;
+}
+//writes as much of m_out as the socket takes
+void flush_bot(bot * b)
+{
+	ssize_t n;
+	while (b->m_out_len > 0)
+	{
+		if ((n = write(b->m_fd, b->m_out, b->m_out_len)) > 0)
+		{
+			memmove(b->m_out, b->m_out + n, b->m_out_len - n);
+			b->m_out_len -= n;
+		}
+		else if (n == -1 && errno == EINTR)
+			continue;
+		else
+			return; //EAGAIN waits for EPOLLOUT, a broken socket shows up as a read error
+	}
+}
+//sends every message whose time has come, staggered so the clients do
+//not all fire in the same tick
+void send_due(worker * w, uint64_t now)
+{
+	uint64_t interval = (uint64_t)(1e9 / config.rate);
+	char text[PAYLOAD_MAX + 1];
+	size_t i, len;
+	bot *b;
+	int burst;
+	for (i = 0; i < w->m_count; i++)
+	{
+		b = &w->m_bots[i];
+		if (b->m_fd == -1)
+			continue;
+		if (b->m_next_send == 0)
+			b->m_next_send = start_ns + interval * (b->m_index % 1000) / 1000;
+		for (burst = 0; b->m_next_send <= now && burst < BURST_LIMIT; burst++)
+		{
+			b->m_next_send += interval;
+			//T<send time in ns> then padding up to the payload size
+			len = snprintf(text, sizeof(text), "T%lu ", (unsigned long)now_ns());
+			memset(text + len, 'x', config.payload - len);
+			if (send_frame(b, FRAME_TEXT, text, config.payload) == -1)
+			{
+				w->m_stalled++;
+				continue;
+			}
+			w->m_sent++;
+			w->m_expected += b->m_peers;
+		}
+		//hopelessly behind, skip ahead instead of bursting forever
+		if (b->m_next_send <= now)
+			b->m_next_send = now + interval;
+	}
+}
+//reads and handles every complete frame, edge-triggered
+void on_bot_readable(worker * w, bot * b)
+{
+	struct frame f;
+	unsigned char *space;
+	size_t room;
+	ssize_t n;
+	int got;
+	for (;;)
+	{
+		space = frame_reader_space(&b->m_in, &room);
+		if ((n = read(b->m_fd, space, room)) > 0)
+		{
+			frame_reader_commit(&b->m_in, n);
+			while ((got = frame_next(&b->m_in, &f)) == 1)
+				on_bot_frame(w, b, &f);
+			if (got == -1)
+			{
+				fprintf(stderr, "bench: malformed frame from the server\n");
+				exit(1);
+			}
+		}
+		else if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		else
+		{
+			//server hung up (slow consumer policy, shutdown, ...)
+			w->m_closed++;
+			close(b->m_fd);
+			b->m_fd = -1;
+			return;
+		}
+	}
+}
+//a notice may finish the handshake, a chat line is a latency sample
+void on_bot_frame(worker * w, bot * b, struct frame * f)
+{
+	char notice[64];
+	const char *at;
+	uint64_t sent;
+	size_t len;
+	if (f->type == FRAME_NOTICE && !b->m_ready)
+	{
+		len = snprintf(notice, sizeof(notice), ">>You are now in %s.", b->m_room);
+		if (f->length >= len && memcmp(f->payload, notice, len) == 0)
+		{
+			b->m_ready = 1;
+			atomic_fetch_add(&ready_count, 1);
+		}
+	}
+	else if (f->type == FRAME_TEXT && atomic_load_explicit(&phase, memory_order_relaxed) != PHASE_CONNECT)
+	{
+		//"bench<n>> T<ns> xxx...", the timestamp is right after the name
+		if ((at = memchr(f->payload, '>', f->length)) == NULL || at + 3 >= f->payload + f->length || at[2] != 'T')
+			return;
+		sent = strtoull(at + 3, NULL, 10);
+		if (sent < start_ns)
+			return;
+		w->m_received++;
+		hist_record(&w->m_latency, now_ns() - sent);
+	}
+}
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+void hist_record(struct histogram * h, uint64_t v)
+{
+	int b = 0, msb;
+	if (v >= HIST_SUB)
+	{
+		msb = 63 - __builtin_clzll(v);
+		b = msb - HIST_SUB_BITS + 1;
+	}
+	h->m_counts[b][v >> b]++;
+	h->m_count++;
+	if (v < h->m_min)
+		h->m_min = v;
+	if (v > h->m_max)
+		h->m_max = v;
+}
+void hist_merge(struct histogram * into, struct histogram * from)
+{
+	int b, s;
+	if (from->m_count == 0)
+		return;
+	for (b = 0; b < HIST_BUCKETS; b++)
+	{
+		for (s = 0; s < HIST_SUB; s++)
+			into->m_counts[b][s] += from->m_counts[b][s];
+	}
+	if (into->m_count == 0 || from->m_min < into->m_min)
+		into->m_min = from->m_min;
+	if (from->m_max > into->m_max)
+		into->m_max = from->m_max;
+	into->m_count += from->m_count;
+}
+//highest value that falls in the same step as the pct-th percentile
+uint64_t hist_percentile(struct histogram * h, double pct)
+{
+	uint64_t want = (uint64_t)(h->m_count * pct / 100.0), seen = 0, top;
+	int b, s;
+	for (b = 0; b < HIST_BUCKETS; b++)
+	{
+		for (s = 0; s < HIST_SUB; s++)
+		{
+			seen += h->m_counts[b][s];
+			if (seen > want)
+			{
+				top = (((uint64_t)s + 1) << b) - 1;
+				return top < h->m_max ? top : h->m_max;
+			}
+		}
+	}
+	return h->m_max;
+}
+//each simulated client is a socket, ask for as many descriptors as we may have
+void raise_fd_limit()
+{
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max)
+	{
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+}
@@ -5,13 +5,23 @@
 /* Client creates a socket to connect to Server.						*/
 /* When the communication is established, Client writes data to server	*/
 /* and echoes the response from Server									*/
+/* Messages travel as length-prefixed frames, see protocol.h			*/
+/* One poll() loop watches both stdin and the socket, so an idle		*/
+/* client sleeps instead of spinning. Replies are read in bulk and		*/
+/* reassembled into frames, typed lines are sent as they complete.		*/
+/* Quit commands are recognised with the table in commands.h.			*/
+/* A line longer than STREAM_CHUNK is streamed in FRAME_CHUNK pieces	*/
+/* as it is typed or pasted, never held whole; stdin is only read		*/
+/* while the server's credit leaves room in the STREAM_WINDOW. Pieces	*/
+/* of other users' streams are printed as they come, a line broken by	*/
+/* another message is picked up again under its sender's name.			*/
 /*																		*/
 /* To run this program, first compile the server1.c and run it			*/
 /* on a server machine. Then run the client program on another			*/
 /* machine.																*/
 /*																		*/
-/* COMPILE: gcc client.c -o client -lnsl -pthread						*/
-/* TO RUN: ./client server-machine-name									*/
+/* COMPILE: gcc client.c -o client -lnsl								*/
+/* TO RUN: ./client server-machine-name [port]							*/
 /*																	    */
 /************************************************************************/
 #include <string.h>
@@ -21,33 +31,66 @@
 #include <sys/socket.h> /* define socket */
 #include <netinet/in.h> /* define internet socket */
 #include <netdb.h> /* define internet socket */
-#include <pthread.h>
+#include <poll.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "commands.h"
 
 #define SERVER_PORT 7777 /* define a server port number */
+#define OUT_SIZE (64 * 1024) //frames waiting for the socket to take them
+#define STREAMS_SHOWN 16 //other users' streams we remember a name for
+#define SENDER_SIZE 64 //"name> " kept for each of them, cut short if longer
 
 //Declare global so other functions can used them
 int quit = 0; //Used to quit program
+int leaving = 0; //quit command sent, waiting for the server's exit directive
+int named = 0; //the first line has gone out as the user name
+int stdin_open = 1;
 int sd;
-
-//Threads to handle read and write
-pthread_t t_read, t_write;
+struct frame_reader in; //bytes from the server, reassembled into frames
+char line[STREAM_CHUNK + 1]; //typed text up to the next newline, or the next chunk
+size_t line_len;
+int streaming = 0; //the line in progress went out in chunks, it ends with FRAME_CHUNK_END
+uint32_t chunk_sent, credited; //running totals, they wrap
+unsigned char out[OUT_SIZE]; //encoded frames not yet written
+size_t out_len;
+//streams being printed, found by the id in front of every piece
+struct incoming
+{
+	uint64_t id;
+	int used;
+	char sender[SENDER_SIZE]; //"name> ", printed again when the line resumes
+} incoming[STREAMS_SHOWN];
+int next_incoming; //slot taken over when all are in use
+int mid_line = 0; //stdout is in the middle of a streamed line
+uint64_t printing; //whose, when mid_line
 
 //Declarations of function used in client.c
 void signalhandler(int sig);
-void *read_handler(void *soc);
-void *write_handler(void *soc);
+void read_server();
+void show_piece(struct frame *f);
+void read_stdin();
+void handle_line(char *text);
+void send_piece(int type, const char *text, size_t len);
+int send_frame(int type, const char *text, size_t len);
+void flush_out();
 
 int main(int argc, char* argv[])
 {
 	struct sockaddr_in server_addr = { AF_INET, htons(SERVER_PORT) };
-	char buf[512];
 	struct hostent *hp;
-	if (argc != 2)
+	struct pollfd fds[2];
+	if (argc != 2 && argc != 3)
 	{
-		printf("Usage: %s [hostname]\n", argv[0]);
+		printf("Usage: %s [hostname] [port]\n", argv[0]);
 		exit(1);
 	}
+	//a server started with -p, e.g. one node of a cluster
+	if (argc == 3)
+		server_addr.sin_port = htons(atoi(argv[2]));
 	/* get the host info */
 	if ((hp = gethostbyname(argv[1])) == NULL)
 	{
@@ -68,20 +111,39 @@ int main(int argc, char* argv[])
 		exit(1);
 	}
 	printf("Server \"%s\" connected!\n", argv[1]);
-	/* create a thread for reading */
-	if (pthread_create(&t_read, NULL, read_handler, NULL) != 0)
+	printf("Please Enter Your User Name\n");
+	fflush(stdout);
+	if (fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK) == -1 || frame_reader_init(&in) == -1)
 	{
-		perror("Error, creating thread for reading failed");
+		perror("client: setup failed");
 		exit(1);
 	}
-	/* create a thread for writing */
-	if (pthread_create(&t_write, NULL, write_handler, NULL) != 0)
+	signal(SIGINT, signalhandler);
+	signal(SIGPIPE, SIG_IGN);
+	while (quit != 1)
 	{
-		perror("Error, creating thread for writing failed");
-		exit(1);
+		//stdin is only read while whatever one read turns into is sure to fit in
+		//out (every byte a newline: an empty frame each) and in the window
+		fds[0].fd = (stdin_open && !leaving && OUT_SIZE - out_len >= FRAME_HEADER_MAX + 2 * STREAM_CHUNK
+			&& (uint32_t)(chunk_sent - credited) <= STREAM_WINDOW - STREAM_CHUNK) ? STDIN_FILENO : -1;
+		fds[0].events = POLLIN;
+		fds[1].fd = sd;
+		fds[1].events = POLLIN | (out_len > 0 ? POLLOUT : 0);
+		//sleeps until there is something to do
+		if (poll(fds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue; //Ctrl-C, the handler already printed the help
+			perror("Error, poll failed");
+			exit(1);
+		}
+		if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+			read_server();
+		if (quit != 1 && (fds[1].revents & POLLOUT))
+			flush_out();
+		if (quit != 1 && (fds[0].revents & (POLLIN | POLLHUP)))
+			read_stdin();
 	}
-	signal(SIGINT, signalhandler);
-	while (quit != 1); //program goes off and does other stuff
 	close(sd); //close the socket
 	return(0);
 }
@@ -91,60 +153,231 @@ void signalhandler(int sig)
 	printf("\n[HELP] Please type \"/quit\", \"/exit\" or \"/part\" in order to exit the chatroom.\n");
 }
 //This function will read the data
-void *read_handler(void *soc)
+//reads everything the socket holds, frames are reassembled from however
+//many bytes each read() returns and printed with one flush per batch
+void read_server()
 {
-	char buf[512];
+	struct frame f;
+	unsigned char *space;
+	size_t room;
+	ssize_t n;
+	int got;
 	while (quit != 1)
 	{
-		//Read the data from socket into buf
-		if (read(sd, buf, sizeof(buf[512])) < 0)
+		space = frame_reader_space(&in, &room);
+		if ((n = read(sd, space, room)) < 0)
 		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
 			perror("Error, there was a problem reading");
 			exit(1);
 		}
-		else
+		else if (n == 0)
+		{
+			printf("Server closed the connection.\n");
+			quit = 1;
+			break;
+		}
+		frame_reader_commit(&in, n);
+		while ((got = frame_next(&in, &f)) == 1)
 		{
-			if (strcmp(buf, "/__quit") == 0)
+			if (f.type == FRAME_QUIT)
 			{
 				quit = 1;
-				pthread_exit(0);
+				break;
+			}
+			if (f.type == FRAME_CREDIT)
+			{
+				//a stale total (handed over twice) must not shrink the window
+				if (f.length == 4 && (int32_t)((uint32_t)frame_get_le(f.payload, 4) - credited) > 0)
+					credited = (uint32_t)frame_get_le(f.payload, 4);
+				continue;
 			}
-			else
+			if (f.type == FRAME_CHUNK || f.type == FRAME_CHUNK_END)
 			{
-				printf("%s", buf);
+				show_piece(&f);
+				continue;
 			}
+			//anything else starts on a line of its own
+			if (mid_line)
+				putchar('\n');
+			mid_line = 0;
+			fwrite(f.payload, 1, f.length, stdout);
+		}
+		if (got == -1)
+		{
+			fprintf(stderr, "Error, malformed data from the server\n");
+			exit(1);
 		}
 	}
+	fflush(stdout);
 }
-//This function will write a message to the server
-void *write_handler(void *soc)
+//prints a piece of someone's stream, after a newline and their name again
+//if something else was printed since the last one
+void show_piece(struct frame *f)
 {
-	char buf[512];
-	char *pos;
-	printf("Please Enter Your User Name\n");
-
-	/*This will get the whole line and ignore the newline char*/
-	fgets(buf, sizeof(buf), stdin);
-	if ((pos = strchr(buf, '\n')) != NULL)
+	const char *text = (const char *)f->payload + STREAM_ID_SIZE, *end;
+	size_t len = f->length - STREAM_ID_SIZE;
+	struct incoming *s = NULL;
+	uint64_t id;
+	int i;
+	if (f->length < STREAM_ID_SIZE)
+		return;
+	id = frame_get_le(f->payload, STREAM_ID_SIZE);
+	for (i = 0; i < STREAMS_SHOWN && s == NULL; i++)
+	{
+		if (incoming[i].used && incoming[i].id == id)
+			s = &incoming[i];
+	}
+	if (s == NULL)
+	{
+		//the first piece starts with the name
+		s = &incoming[next_incoming];
+		next_incoming = (next_incoming + 1) % STREAMS_SHOWN;
+		s->id = id;
+		s->used = 1;
+		s->sender[0] = '\0';
+		for (end = text; end + 1 < text + len && end + 2 - text < SENDER_SIZE; end++)
+		{
+			if (end[0] == '>' && end[1] == ' ')
+			{
+				memcpy(s->sender, text, end + 2 - text);
+				s->sender[end + 2 - text] = '\0';
+				break;
+			}
+		}
+		if (mid_line)
+			putchar('\n');
+	}
+	else if (!mid_line || printing != id)
+	{
+		if (mid_line)
+			putchar('\n');
+		fputs(s->sender, stdout);
+	}
+	fwrite(text, 1, len, stdout);
+	printing = id;
+	mid_line = f->type == FRAME_CHUNK;
+	if (f->type == FRAME_CHUNK_END)
+		s->used = 0;
+}
+//reads what the user typed, every complete line is one message
+void read_stdin()
+{
+	char *start, *pos;
+	ssize_t n;
+	if ((n = read(STDIN_FILENO, line + line_len, STREAM_CHUNK - line_len)) < 0)
+	{
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		perror("Error, there was a problem reading input");
+		exit(1);
+	}
+	if (n == 0)
+	{
+		//stdin closed, send what is left and leave politely
+		stdin_open = 0;
+		if (streaming)
+			send_piece(FRAME_CHUNK_END, line, line_len);
+		else if (line_len > 0)
+		{
+			line[line_len] = '\0';
+			handle_line(line);
+		}
+		line_len = 0;
+		if (!named)
+			quit = 1; //never gave a name, nothing to say goodbye to
+		else if (!leaving)
+			handle_line("/quit");
+		return;
+	}
+	line_len += n;
+	start = line;
+	while (!leaving && (pos = memchr(start, '\n', line + line_len - start)) != NULL)
+	{
+		/*ignore the newline char*/
 		*pos = '\0';
-
-	/*take name, send it to the server */
-	write(sd, buf, sizeof(buf));
-	printf("Attempting to connect with server, if server is full please wait...\n");
-	while (quit != 1)
+		if (streaming)
+			send_piece(FRAME_CHUNK_END, start, pos - start);
+		else
+			handle_line(start);
+		start = pos + 1;
+	}
+	line_len -= start - line;
+	memmove(line, start, line_len);
+	//a line too long for the buffer is streamed, a buffer at a time
+	if (!leaving && line_len == STREAM_CHUNK)
 	{
-		/*This will get the whole line and ignore the newline char*/
-		fgets(buf, sizeof(buf), stdin);
-		if ((pos = strchr(buf, '\n')) != NULL)
-			*pos = '\0';
-
-		write(sd, buf, sizeof(buf));
-		if ((strcmp(buf, "/exit") == 0) || (strcmp(buf, "/quit") == 0) || (strcmp(buf, "/part") == 0))
+		if (named)
+			send_piece(FRAME_CHUNK, line, line_len);
+		else
 		{
-			printf("Quitting now...");
-			quit = 1;
-			pthread_exit(0);
+			line[line_len] = '\0';
+			handle_line(line); //too long for a name, the server says so
+		}
+		line_len = 0;
+	}
+}
+//the first line is the user name, the rest are chat messages
+void handle_line(char *text)
+{
+	struct command cmd;
+	int id;
+	if (!named)
+	{
+		/*take name, send it to the server */
+		send_frame(FRAME_NAME, text, strlen(text));
+		named = 1;
+		printf("Attempting to connect with server, if server is full please wait...\n");
+		fflush(stdout);
+		return;
+	}
+	send_frame(FRAME_TEXT, text, strlen(text));
+	//same table as the server, so both agree on what leaves
+	id = command_parse(text, &cmd);
+	if (id == CMD_QUIT || id == CMD_EXIT || id == CMD_PART)
+	{
+		//keep reading until the server's exit directive, nothing is lost
+		printf("Quitting now...");
+		fflush(stdout);
+		leaving = 1;
+	}
+}
+//sends a piece of a streamed line, it counts against the window until credited
+void send_piece(int type, const char *text, size_t len)
+{
+	send_frame(type, text, len);
+	chunk_sent += len;
+	streaming = type == FRAME_CHUNK;
+}
+//queues len bytes of text as one frame, only the bytes actually used go out
+int send_frame(int type, const char *text, size_t len)
+{
+	len = frame_encode(out + out_len, OUT_SIZE - out_len, type, text, len);
+	if (len == 0)
+		return -1;
+	out_len += len;
+	flush_out();
+	return 0;
+}
+//writes as much queued output as the socket takes, the rest waits for POLLOUT
+void flush_out()
+{
+	ssize_t n;
+	while (out_len > 0)
+	{
+		if ((n = write(sd, out, out_len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			perror("Error, there was a problem writing");
+			exit(1);
 		}
+		memmove(out, out + n, out_len - n);
+		out_len -= n;
 	}
-	quit = 1;
 }
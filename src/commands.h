@@ -0,0 +1,148 @@
+/************************************************************************/
+/*   PROGRAM NAME: commands.h  (included by server.c and client.c)      */
+/*                                                                      */
+/*   Slash commands typed by users. A line that does not start with '/' */
+/*   is chat text and costs one byte compare. A command's name is found */
+/*   through a perfect hash over its length, first and last character,  */
+/*   the slots are computed by the compiler (COMMAND_HASH in the table  */
+/*   initializer) and one memcmp() confirms the match, so recognising a */
+/*   command is O(length) whatever the number of commands.              */
+/*                                                                      */
+/*   Each command declares what argument it takes and command_parse()   */
+/*   checks it, so the handlers get typed arguments and never re-parse. */
+/*                                                                      */
+/*   To add a command: give it an id and a table entry. If its slot is  */
+/*   already taken (gcc -Wextra reports the overridden initializer),    */
+/*   pick new multipliers for COMMAND_HASH or a bigger table.           */
+/*                                                                      */
+/************************************************************************/
+#ifndef CHAT_COMMANDS_H
+#define CHAT_COMMANDS_H
+
+#include <stddef.h>
+#include <string.h>
+
+#define COMMAND_TABLE 16 //slots in the hash table, a power of two
+#define COMMAND_HASH(len, first, last) (((len) * 2 + (first) + (last) * 6) & (COMMAND_TABLE - 1))
+
+//what a line turned out to be
+enum command_id
+{
+	CMD_NONE,	//chat text, not a command
+	CMD_UNKNOWN,	//starts with '/' but is no command we know
+	CMD_BAD_ARGS,	//a known command with missing or extra arguments
+	CMD_QUIT,
+	CMD_EXIT,
+	CMD_PART,
+	CMD_JOIN,
+	CMD_LEAVE,
+	CMD_NICK,
+	CMD_MSG,
+	CMD_HISTORY
+};
+
+//the argument a command takes
+enum command_arg
+{
+	ARG_NONE,	//nothing may follow the name
+	ARG_NAME,	//the rest of the line, required: a room or a nick
+	ARG_NAME_TEXT,	//one word, then the rest of the line, both required
+	ARG_COUNT	//an optional decimal number
+};
+
+struct command_spec
+{
+	const char *m_name; //without the '/', NULL for an empty slot
+	size_t m_len;
+	int m_id; //one of command_id
+	int m_arg; //one of command_arg
+	const char *m_usage;
+};
+
+//a parsed line, the pointers point into the line that was parsed
+struct command
+{
+	int id; //one of command_id
+	const struct command_spec *spec; //NULL for CMD_NONE and CMD_UNKNOWN
+	const char *name; //ARG_NAME and ARG_NAME_TEXT, nul-terminated for ARG_NAME only
+	size_t name_len;
+	const char *text; //ARG_NAME_TEXT, the rest of the line
+	unsigned long count; //ARG_COUNT, 0 when none was given
+};
+
+#define COMMAND_ENTRY(name, first, last, id, arg, usage) \
+	[COMMAND_HASH(sizeof(name) - 1, first, last)] = { name, sizeof(name) - 1, id, arg, usage }
+
+static const struct command_spec command_table[COMMAND_TABLE] =
+{
+	COMMAND_ENTRY("quit", 'q', 't', CMD_QUIT, ARG_NONE, "/quit"),
+	COMMAND_ENTRY("exit", 'e', 't', CMD_EXIT, ARG_NONE, "/exit"),
+	COMMAND_ENTRY("part", 'p', 't', CMD_PART, ARG_NONE, "/part"),
+	COMMAND_ENTRY("join", 'j', 'n', CMD_JOIN, ARG_NAME, "/join <room>"),
+	COMMAND_ENTRY("leave", 'l', 'e', CMD_LEAVE, ARG_NONE, "/leave"),
+	COMMAND_ENTRY("nick", 'n', 'k', CMD_NICK, ARG_NAME, "/nick <name>"),
+	COMMAND_ENTRY("msg", 'm', 'g', CMD_MSG, ARG_NAME_TEXT, "/msg <name> <text>"),
+	COMMAND_ENTRY("history", 'h', 'y', CMD_HISTORY, ARG_COUNT, "/history [lines]")
+};
+
+//classifies line and fills in cmd, returns cmd->id
+static inline int command_parse(const char *line, struct command *cmd)
+{
+	const char *name = line + 1, *end, *arg;
+	const struct command_spec *spec;
+	size_t len;
+	cmd->id = CMD_NONE;
+	cmd->spec = NULL;
+	cmd->name = cmd->text = NULL;
+	cmd->name_len = 0;
+	cmd->count = 0;
+	if (line[0] != '/')
+		return CMD_NONE;
+	for (end = name; *end != '\0' && *end != ' '; end++)
+		;
+	len = end - name;
+	cmd->id = CMD_UNKNOWN;
+	if (len == 0)
+		return CMD_UNKNOWN;
+	spec = &command_table[COMMAND_HASH(len, (unsigned char)name[0], (unsigned char)name[len - 1])];
+	if (spec->m_name == NULL || spec->m_len != len || memcmp(spec->m_name, name, len) != 0)
+		return CMD_UNKNOWN;
+	cmd->spec = spec;
+	cmd->id = CMD_BAD_ARGS;
+	for (arg = end; *arg == ' '; arg++)
+		;
+	switch (spec->m_arg)
+	{
+	case ARG_NONE:
+		if (*arg != '\0')
+			return CMD_BAD_ARGS;
+		break;
+	case ARG_NAME:
+		if (*arg == '\0')
+			return CMD_BAD_ARGS;
+		cmd->name = arg;
+		cmd->name_len = strlen(arg);
+		break;
+	case ARG_NAME_TEXT:
+		for (end = arg; *end != '\0' && *end != ' '; end++)
+			;
+		cmd->name = arg;
+		cmd->name_len = end - arg;
+		while (*end == ' ')
+			end++;
+		if (cmd->name_len == 0 || *end == '\0')
+			return CMD_BAD_ARGS;
+		cmd->text = end;
+		break;
+	case ARG_COUNT:
+		for (; *arg >= '0' && *arg <= '9'; arg++)
+			cmd->count = cmd->count * 10 + (*arg - '0');
+		if (*arg != '\0')
+			return CMD_BAD_ARGS;
+		break;
+	}
+	cmd->id = spec->m_id;
+	return cmd->id;
+}
+
+#endif
@@ -0,0 +1,196 @@
+/************************************************************************/
+/*   PROGRAM NAME: protocol.h  (included by server.c and client.c)      */
+/*                                                                      */
+/*   Wire framing shared by the server and the client. Every message    */
+/*   on the socket is one frame:                                        */
+/*                                                                      */
+/*       [payload length, varint][type, 1 byte][payload]                */
+/*                                                                      */
+/*   The length is a little-endian base-128 varint (7 bits per byte,    */
+/*   high bit set on all but the last byte), so a short chat line costs */
+/*   two bytes of overhead instead of a padded 1024 byte record.        */
+/*   Payloads are raw bytes and are NOT nul-terminated on the wire.     */
+/*                                                                      */
+/*   struct frame_reader reassembles frames from a byte stream: it      */
+/*   copes with a frame split over several read()s and with several     */
+/*   frames arriving in a single read().                                */
+/*                                                                      */
+/*   A message too long for one frame is streamed: the client sends it  */
+/*   as FRAME_CHUNK pieces of at most STREAM_CHUNK bytes and ends it    */
+/*   with a FRAME_CHUNK_END piece. The server passes every piece on as  */
+/*   it arrives, prefixed with a stream id (8 bytes, little-endian) so  */
+/*   recipients can tell interleaved streams apart. A client may have   */
+/*   STREAM_WINDOW chunk bytes unacknowledged; FRAME_CREDIT carries the */
+/*   running total of chunk bytes the server has passed on to everyone  */
+/*   (4 bytes, little-endian, wrapping), and each one frees that much   */
+/*   of the window again.                                               */
+/*                                                                      */
+/************************************************************************/
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_MAX_PAYLOAD 4096 //largest payload a peer will accept
+#define FRAME_HEADER_MAX 6 //5 varint bytes (32 bit length) + type byte
+#define FRAME_READER_SIZE 8192 //initial reassembly buffer
+#define STREAM_CHUNK 3072 //largest piece a client puts in one FRAME_CHUNK
+#define STREAM_WINDOW (256 * 1024) //chunk bytes a client may send ahead of its credit
+#define STREAM_MAX (8 * 1024 * 1024) //longest streamed message, the server cuts the rest
+#define STREAM_ID_SIZE 8 //stream id in front of every piece the server sends
+
+//what a frame carries
+enum frame_type
+{
+	FRAME_NAME = 1,	//client -> server, user name handshake
+	FRAME_TEXT = 2,	//a chat line, either direction
+	FRAME_NOTICE = 3,	//server -> client, ">>..." announcements
+	FRAME_QUIT = 4,	//server -> client, the exit directive (old "/__quit")
+	FRAME_CHUNK = 5,	//a piece of a streamed message, more follow
+	FRAME_CHUNK_END = 6,	//its last piece
+	FRAME_CREDIT = 7	//server -> client, chunk bytes passed on so far
+};
+
+//one decoded frame, payload points into the reader's buffer and is
+//only valid until the next frame_reader_* call
+struct frame
+{
+	int type;
+	const char *payload;
+	size_t length;
+};
+
+//reassembly buffer, bytes [m_start, m_len) are received but not yet consumed
+struct frame_reader
+{
+	unsigned char *m_buf;
+	size_t m_start;
+	size_t m_len;
+	size_t m_cap;
+};
+
+//writes the frame header for a payload of len bytes into out
+//out must have room for FRAME_HEADER_MAX bytes, returns the header size
+static inline size_t frame_put_header(unsigned char *out, int type, size_t len)
+{
+	size_t n = 0;
+	while (len >= 0x80)
+	{
+		out[n++] = (unsigned char)(len | 0x80);
+		len >>= 7;
+	}
+	out[n++] = (unsigned char)len;
+	out[n++] = (unsigned char)type;
+	return n;
+}
+
+//encodes a whole frame into out, returns its size or 0 if it does not fit
+static inline size_t frame_encode(unsigned char *out, size_t cap, int type, const void *payload, size_t len)
+{
+	unsigned char header[FRAME_HEADER_MAX];
+	size_t h = frame_put_header(header, type, len);
+	if (h + len > cap)
+		return 0;
+	memcpy(out, header, h);
+	memcpy(out + h, payload, len);
+	return h + len;
+}
+
+//n byte little-endian integers inside payloads (stream ids, credit)
+static inline void frame_put_le(unsigned char *out, uint64_t value, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		out[i] = (unsigned char)(value >> (8 * i));
+}
+
+static inline uint64_t frame_get_le(const void *in, int n)
+{
+	const unsigned char *p = (const unsigned char *)in;
+	uint64_t value = 0;
+	int i;
+	for (i = n - 1; i >= 0; i--)
+		value = value << 8 | p[i];
+	return value;
+}
+
+//0 on success, -1 if out of memory
+static inline int frame_reader_init(struct frame_reader *r)
+{
+	r->m_start = 0;
+	r->m_len = 0;
+	r->m_cap = FRAME_READER_SIZE;
+	r->m_buf = malloc(r->m_cap);
+	return r->m_buf == NULL ? -1 : 0;
+}
+
+static inline void frame_reader_free(struct frame_reader *r)
+{
+	free(r->m_buf);
+	r->m_buf = NULL;
+	r->m_start = r->m_len = r->m_cap = 0;
+}
+
+static inline void frame_reader_reset(struct frame_reader *r)
+{
+	r->m_start = 0;
+	r->m_len = 0;
+}
+
+//returns where the next read() should land and how much room is there
+//(*space), compacting the buffer first so the room is never tiny
+static inline unsigned char *frame_reader_space(struct frame_reader *r, size_t *space)
+{
+	if (r->m_start > 0)
+	{
+		memmove(r->m_buf, r->m_buf + r->m_start, r->m_len - r->m_start);
+		r->m_len -= r->m_start;
+		r->m_start = 0;
+	}
+	*space = r->m_cap - r->m_len;
+	return r->m_buf + r->m_len;
+}
+
+//records that n bytes were read into the space handed out above
+static inline void frame_reader_commit(struct frame_reader *r, size_t n)
+{
+	r->m_len += n;
+}
+
+//pulls the next complete frame out of the reader
+// 1 -> *f holds a frame
+// 0 -> need more bytes
+//-1 -> malformed stream (bad varint or payload over FRAME_MAX_PAYLOAD)
+static inline int frame_next(struct frame_reader *r, struct frame *f)
+{
+	const unsigned char *p = r->m_buf + r->m_start;
+	size_t avail = r->m_len - r->m_start;
+	size_t len = 0, i = 0;
+	int shift = 0;
+	for (;;)
+	{
+		if (i == avail)
+			return 0;
+		if (i == FRAME_HEADER_MAX - 1)
+			return -1;
+		len |= (size_t)(p[i] & 0x7f) << shift;
+		shift += 7;
+		if ((p[i++] & 0x80) == 0)
+			break;
+	}
+	if (len > FRAME_MAX_PAYLOAD)
+		return -1;
+	if (avail < i + 1 + len)
+		return 0;
+	f->type = p[i];
+	f->payload = (const char *)(p + i + 1);
+	f->length = len;
+	r->m_start += i + 1 + len;
+	if (r->m_start == r->m_len)
+		r->m_start = r->m_len = 0;
+	return 1;
+}
+
+#endif
@@ -1,5 +1,5 @@
 /************************************************************************/
-/*   PROMGRAMMER NAMES: Neshat Osmani and Xiao Deng						*/				
+/*   PROMGRAMMER NAMES: Neshat Osmani and Xiao Deng						*/
 /*   PROGRAM NAME: server.c  (works with client.c)                     */
 /*                                                                      */
 /*   Server creates a socket to listen for the connection from Client   */
@@ -14,78 +14,1195 @@
 /*   Using accept() to accept a connection on a socket. It returns      */
 /*   the descriptor for the accepted socket.                            */
 /*                                                                      */
+/*   All sockets are non-blocking and owned by epoll loops (reactors,   */
+/*   edge-triggered). There is one reactor thread per core, each with   */
+/*   its own SO_REUSEPORT listener, so the kernel spreads connections.  */
+/*   Each client is a small state machine: waiting                      */
+/*   for its name, chatting, or closing once its output is flushed.     */
+/*   Messages travel as length-prefixed frames, see protocol.h.         */
+/*   A broadcast is encoded once into a reference-counted message and   */
+/*   each recipient's queue just holds a pointer to it.                 */
+/*   Queued frames are not written right away: a socket that got frames */
+/*   during a loop pass is flushed once at its end (or when a -w window */
+/*   expires), with one writev() for up to FLUSH_IOV frames. Nagle is   */
+/*   off, and TCP_CORK holds back partial packets while one flush needs */
+/*   several calls.                                                     */
+/*   Queues are bounded; when a client falls behind the slow consumer   */
+/*   policy drops its oldest frames, coalesces them, or disconnects it. */
+/*   Chunks of a streamed message are never dropped or coalesced: a     */
+/*   client whose backlog is nothing but chunks is disconnected.        */
+/*   Sessions live in a slab that grows in chunks, with a free list for */
+/*   O(1) slot reuse. epoll refers to them by generation-tagged handle  */
+/*   so an event for a closed client can never reach its successor.    */
+/*   Clients talk in rooms (/join <room>, /leave back to the lobby).    */
+/*   Slash commands are recognised through a perfect-hash table shared  */
+/*   with the client, see commands.h.                                   */
+/*   Names are unique: a hash index maps each one to its session's      */
+/*   reactor and handle, so /msg <name> reaches one person in constant  */
+/*   time, through the owner's mailbox when it lives on another reactor.*/
+/*   Rooms are found through a hash table and keep a compact member     */
+/*   array, so a broadcast only touches the people in that room.       */
+/*   Every reactor keeps its own share of each room's members. A        */
+/*   broadcast is delivered locally and handed to the other reactors    */
+/*   with members in the room through their mailboxes: lock-free        */
+/*   multi-producer/single-consumer queues with an eventfd wakeup, so   */
+/*   no reactor ever waits on a lock held by another.                   */
+/*   Frames, mails and per-client buffers come from per-reactor         */
+/*   size-classed pools instead of malloc(). Sessions are kept small:   */
+/*   short names are stored inline, the outbound ring starts at a few  */
+/*   slots and a receive buffer only exists while a frame is split     */
+/*   across reads.                                                      */
+/*   Log lines never touch stdout on a reactor: each thread appends     */
+/*   them to its own lock-free ring and a flusher thread batches them   */
+/*   into large writes, as text lines or binary records.                */
+/*   With -H every room's chat lines are appended to memory-mapped log  */
+/*   segment files on disk (synced once a second), and whoever joins a  */
+/*   room is sent its last lines straight from those files with         */
+/*   sendfile(). A history thread opens the logs and keeps the next     */
+/*   segment mapped ahead of time, so a reactor only ever copies a      */
+/*   frame into memory and never waits on the disk.                     */
+/*   Each room also keeps its last -K frames in memory (references to  */
+/*   the very messages that were broadcast), so most joins are served   */
+/*   without touching the disk at all. A room's lines are recorded by   */
+/*   its home reactor alone (the others mail them there), and joins on  */
+/*   any reactor read the ring without a lock.                          */
+/*   Ctrl-C (or SIGTERM) arrives on a signalfd read by the main thread, */
+/*   which walks the reactors through a shutdown: stop accepting and    */
+/*   queue a notice, give people -g seconds to leave, then queue the    */
+/*   exit directive to everyone and close whoever is not flushed after  */
+/*   -d milliseconds. A second Ctrl-C skips the wait.                   */
+/*   With -U the server also listens on a Unix socket for its own       */
+/*   replacement: a new ./server started with the same -U path connects */
+/*   there and is handed the listening sockets and every client socket  */
+/*   (SCM_RIGHTS) together with each client's name, room, unsent output */
+/*   and half-read frame, so an upgrade drops no connections.           */
+/*   With -M port, http://127.0.0.1:port/ serves live metrics in the    */
+/*   Prometheus text format. Every reactor keeps its own counters and   */
+/*   histograms (written only by itself, so no locks or locked          */
+/*   instructions); a scrape adds them up.                              */
+/*   Built with -DCHAT_TRACE, every chat line is timestamped as it is   */
+/*   read, parsed, handed to its room, queued and written, and the      */
+/*   shutdown statistics show where the time went, stage by stage.      */
+/*   Without it the tracing compiles to nothing.                        */
+/*   Several servers can form a cluster: -L opens a port for other      */
+/*   nodes and -J dials one. A link thread per node tells its peers     */
+/*   which rooms have members here, and a broadcast crosses a link      */
+/*   only if the peer has people in that room. Forwarded frames are     */
+/*   gathered per peer and written once per loop pass. Links form a    */
+/*   full mesh, a node never passes on what another node sent it.      */
+/*   With -i uring the reactors drive their sockets through io_uring    */
+/*   instead of epoll: one multishot accept per listener, one multishot */
+/*   recv per client that lands in a ring of kernel-picked buffers, and */
+/*   each flush becomes a chain of linked writev()s, all submitted and  */
+/*   reaped with a single io_uring_enter() per loop pass. Both backends */
+/*   count their I/O syscalls, so the same load can be compared.        */
+/*   Reads land in reference-counted receive blocks. A long chat line   */
+/*   is not copied into its broadcast: the message holds the header and */
+/*   the name, points at the text where it was read and keeps the block */
+/*   alive, and writev() gathers the pieces for every recipient. The    */
+/*   reader moves on to fresh space while sliced lines are in flight.   */
+/*   A message too long for one frame arrives as FRAME_CHUNK pieces     */
+/*   (see protocol.h). Each piece is sliced and broadcast as soon as it */
+/*   is read, so a paste of megabytes is never held whole. A chunk that */
+/*   has reached every recipient is credited back to its sender, which  */
+/*   keeps at most STREAM_WINDOW bytes of its own in flight: a slow     */
+/*   room slows the paste, not the server or the other rooms.           */
+/*   Credit stops at the link thread: what crosses to another node is   */
+/*   held by the link, which drops a peer LINK_OUT_MAX (16 MiB) behind, */
+/*   and there by each recipient's bounded queue, not by STREAM_WINDOW. */
+/*                                                                      */
 /*   To run this program, first compile the server1.c and run it        */
 /*   on a server machine. Then run the client program on another        */
 /*   machine.                                                           */
 /*                                                                      */
 /*   COMPILE:         gcc -o server server.c -lnsl -pthread            */
-/*	 TO RUN:		  ./server											*/
+/*   (tracing)        gcc -DCHAT_TRACE -o server server.c -lnsl -pthread */
+/*	 TO RUN:		  ./server [-r reactors] [-c clients] [-b backlog]	*/
+/*					  [-q depth]										*/
+/*					  [-s drop|coalesce|disconnect]						*/
+/*					  [-l error|warn|info|debug] [-f line|binary]		*/
+/*					  [-H history dir] [-N replayed lines]				*/
+/*					  [-K scrollback frames]							*/
+/*					  [-g grace seconds] [-d drain ms]					*/
+/*					  [-U handoff socket] [-M metrics port]			*/
+/*					  [-p port] [-L link port] [-J host:port]...		*/
+/*					  [-w flush window us] [-i epoll|uring]				*/
 /*                                                                      */
 /************************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
-#include <pthread.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <poll.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include "protocol.h"
+#include "commands.h"
 
 #define SERVER_PORT 7777 /* define a server port number */
-#define MAX_CLIENT 10
+#define MAX_CLIENT 100000 //default cap on concurrent sessions
+#define LISTEN_BACKLOG 128 //default listen() backlog
+#define SLAB_CHUNK 1024 //sessions added each time the table grows
 #define BUFFER_SIZE 1024
-
-//Two mutexes are used, prevent any race conditions for read + write
-pthread_mutex_t accept_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
-struct sockaddr_in server_addr;
-struct sockaddr_in client_addr;
+#define MAX_EVENTS 64 //events handled per epoll_wait() call
+#define QUEUE_DEPTH 1024 //default outbound queue slots per client
+#define FLUSH_IOV 64 //frames handed to a single writev()
+#define FLUSH_PARTS (3 * FLUSH_IOV) //iovecs for them, a sliced frame takes three
+#define SLICE_MIN 512 //chat lines this long are broadcast from the receive buffer, not copied
+#define SLICE_MAX (FRAME_MAX_PAYLOAD - ROOM_NAME_SIZE - 1) //longest payload they get, it still crosses a link
+#define COALESCE_LIMIT (256 * 1024) //most bytes a coalesced backlog may hold
+#define LISTENER_HANDLE UINT64_MAX //epoll tag of the listening socket
+#define WAKE_HANDLE (UINT64_MAX - 1) //epoll tag of the reactor's eventfd
+#define FLUSH_HANDLE (UINT64_MAX - 2) //epoll tag of the reactor's flush timer (-w)
+#define FLUSH_WINDOW_MAX 1000000 //longest -w, in microseconds
+#define URING_ENTRIES 4096 //-i uring: submission slots per reactor
+#define URING_BUFFERS 1024 //provided receive buffers per reactor, a power of two
+#define URING_BUF_SIZE 4096 //bytes in each of them
+#define URING_CHAIN 4 //linked writev()s one flush may submit, FLUSH_IOV frames each
+#define URING_DATA(op, value) ((uint64_t)(op) << 56 | ((uint64_t)(value) & 0x00ffffffffffffffull))
+#define MAX_REACTORS 64 //upper limit for -r
+#define LATENCY_BUCKETS 64 //power-of-two nanosecond buckets
+#define CACHE_LINE 64
+#define ROOM_NAME_SIZE 64 //longest room name + 1
+#define ROOM_BUCKETS 64 //initial hash buckets, doubled as rooms are added
+#define ROOM_HOME(r) ((r)->m_hash % config.reactors) //reactor that records a room's lines and remote traffic
+#define DEFAULT_ROOM "lobby" //where everyone starts out
+#define POOL_CLASSES 8 //pool block sizes, 64 bytes to 8 KiB doubling each time
+#define POOL_MIN_SHIFT 6 //the smallest block is 1 << POOL_MIN_SHIFT bytes
+#define POOL_SLAB (64 * 1024) //bytes taken from malloc() each time a class runs dry
+#define POOL_HEAP POOL_CLASSES //class tag of blocks too big for the pool
+#define RX_BLOCK_CAP (((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1)) - sizeof(pool_block) - sizeof(rx_block))
+#define RX_READ_MIN (FRAME_HEADER_MAX + FRAME_MAX_PAYLOAD) //room a read into a shared block gets, a whole frame
+#define NAME_INLINE 24 //names shorter than this are kept inside the session
+#define NICK_SIZE 32 //longest user name + 1
+#define NICK_BUCKETS 256 //initial name index buckets, doubled as people arrive
+#define QUEUE_INITIAL 8 //outbound slots a new client starts with
+#define LOG_RING (1024 * 1024) //bytes in each thread's log ring
+#define LOG_TEXT_MAX 2048 //longest log text, longer records are cut
+#define LOG_BATCH (64 * 1024) //bytes the flusher gathers per write()
+#define LOG_FLUSH_MS 10 //flusher nap when every ring is empty
+#define LOG_MAX_RINGS 128 //threads that may log
+#define LOG_PAD UINT32_MAX //record length that marks the skipped end of a ring
+#define LOG_ALIGN(n) (((n) + 15) & ~(size_t)15) //records start on 16 byte boundaries
+#define LOG_SOURCE_OTHER 255 //log source of threads that are not reactors
+#define HISTORY_SEGMENT (4 * 1024 * 1024) //bytes per room log segment file
+#define HISTORY_REPLAY 20 //default lines replayed to someone joining a room
+#define HISTORY_SYNC_MS 1000 //how often appended history is synced to disk
+#define HISTORY_PATH 512 //longest segment file path
+#define HISTORY_HELD 1024 //frames a log holds back while it has no segment ready
+#define SCROLLBACK 64 //default frames each room keeps in memory
+#define SHUTDOWN_GRACE 10 //default seconds between the shutdown notice and the exit directive
+#define SHUTDOWN_DRAIN_MS 2000 //default time clients get to take their last frames
+#define HANDOFF_MAGIC 0x43484f32 //"CHO2", first word of a handoff
+#define HANDOFF_END UINT32_MAX //m_state of the record after the last session
+#define METRIC_BUCKETS 32 //power-of-two histogram buckets
+#define METRICS_POLL_MS 100 //how often the metrics thread checks whether to stop
+#define LINK_MAX_PEERS 64 //links a node may have, one bit each in a room's m_peers
+#define LINK_RETRY_MS 1000 //how often a -J peer that is not linked is dialed again
+#define LINK_OUT_MAX (16 * 1024 * 1024) //unsent bytes a peer may fall behind before it is dropped
+#define LINK_ROOMS_MAX 4096 //rooms the peers together may have created here, rooms are never freed
 
 enum brain_helper
 {
 	EMPTY_CLIENT = -1
 };
 
-//socket, accept, and read
-int sd;
-//length buffer
-int length;
-//Porgram exit flag
-int exit_flag = 0;
+//what to do with a client whose outbound queue is full
+enum slow_policy
+{
+	POLICY_DROP_OLDEST,	//throw away its oldest unsent frame
+	POLICY_COALESCE,	//merge the unsent frames into one buffer
+	POLICY_DISCONNECT	//kick it out
+};
+
+//the states a connection moves through, replaces the old per-client thread
+enum client_state
+{
+	STATE_NAME,	//connected, waiting for the user name
+	STATE_CHAT,	//name received, messages are broadcast
+	STATE_CLOSING	//exit directive queued, close once it is flushed
+};
+
+#ifdef CHAT_TRACE
+//where a chat line's time goes, each stage starts where the one before ended
+//except that write is measured from room (queue slots carry no stamp),
+//so it includes the time spent queued behind other frames
+enum trace_stage
+{
+	TRACE_PARSE,	//read() returned -> frame decoded
+	TRACE_ROOM,	//frame decoded -> about to reach the room's members (dispatch, log, encode, scrollback)
+	TRACE_ENQUEUE,	//room -> on a recipient's queue, through a mailbox for other reactors
+	TRACE_WRITE,	//room -> completely written to a recipient
+	TRACE_TOTAL,	//read() returned -> completely written to a recipient
+	TRACE_STAGES
+};
+//stamps one of the current line's stage times
+#define TRACE_STAMP(field) ((field) = now_ns())
+//adds the time since a stamp to a stage histogram, 0 means not traced
+#define TRACE_RECORD(stage, since) trace_record(stage, since)
+#else
+#define TRACE_STAMP(field) ((void)0)
+#define TRACE_RECORD(stage, since) ((void)0)
+#endif
+
+//how the reactors wait for and do their socket I/O
+enum io_backend
+{
+	BACKEND_EPOLL,	//readiness events, then accept()/read()/writev() ourselves
+	BACKEND_URING	//io_uring does the I/O and reports completions
+};
+
+//-i uring: what a completion is for, the top byte of its user_data
+enum uring_op
+{
+	URING_ACCEPT = 1,	//the listener's multishot accept
+	URING_RECV,	//a client's multishot recv, the rest is its handle with the generation cut to 24 bits
+	URING_SEND,	//a writev, the rest points at its struct uring_send
+	URING_WAKE,	//the mailbox eventfd is readable
+	URING_FLUSH,	//the -w timer fired
+	URING_CANCEL	//a cancel request finished
+};
+
+//how far the server is in shutting down, only ever moves forward
+enum shutdown_phase
+{
+	SHUTDOWN_NONE,	//running normally
+	SHUTDOWN_NOTICE,	//listeners closed, notice queued, people may still chat and leave
+	SHUTDOWN_DRAIN,	//exit directive queued, closing clients as their queues empty
+	SHUTDOWN_HANDOFF	//a new server takes over, the reactors just stop
+};
+
+//frames on a link between two nodes, same framing as protocol.h
+enum link_frame
+{
+	LINK_HELLO = 1,	//first frame both ways, the sender's node id in hex
+	LINK_JOIN = 2,	//the sender has members in the named room now
+	LINK_PART = 3,	//the sender's last member left the named room
+	LINK_ROOM = 4	//a broadcast: frame type byte, room name, nul, frame payload
+};
+
+//how much the logger lets through, each level includes the ones above it
+enum log_level
+{
+	LOG_ERROR,
+	LOG_WARN,
+	LOG_INFO,	//joins, leaves and chat lines
+	LOG_DEBUG
+};
+
+//what the flusher writes
+enum log_format
+{
+	LOG_LINE,	//"hh:mm:ss.micros LEVEL text\n"
+	LOG_BINARY	//struct log_header followed by m_len bytes of text
+};
+
+//set by the main thread, every reactor follows it on its next loop pass
+atomic_int shutdown_phase = SHUTDOWN_NONE;
+
+//runtime settings, filled in from the command line by parse_options()
+struct server_config
+{
+	int reactors; //event loop threads, one per core by default
+	size_t max_clients; //sessions the slabs may grow to, split over the reactors
+	int backlog; //listen() backlog
+	size_t queue_depth; //max frames waiting per client
+	int slow_policy; //one of slow_policy
+	int log_level; //one of log_level, anything above it is not recorded
+	int log_format; //one of log_format
+	const char *history_dir; //where the room logs go, NULL keeps no history
+	size_t history_replay; //lines sent to someone joining a room
+	size_t scrollback; //frames each room keeps in memory, 0 for none
+	int shutdown_grace; //seconds between the shutdown notice and the exit directive
+	int shutdown_drain; //ms the reactors wait for queues to empty before closing anyway
+	const char *handoff_path; //Unix socket a replacement server takes over through, NULL for none
+	int metrics_port; //loopback port of the metrics endpoint, 0 for none
+	int port; //where clients connect
+	int link_port; //where other nodes link to us, 0 for none
+	const char *link_to[LINK_MAX_PEERS]; //host:port of the nodes we dial
+	int link_dials;
+	long flush_window; //us queued frames may wait for company, 0 flushes at the end of each loop pass
+	int backend; //one of io_backend
+} config = { 0, MAX_CLIENT, LISTEN_BACKLOG, QUEUE_DEPTH, POLICY_DISCONNECT, LOG_INFO, LOG_LINE, NULL, HISTORY_REPLAY, SCROLLBACK,
+	SHUTDOWN_GRACE, SHUTDOWN_DRAIN_MS, NULL, 0, SERVER_PORT, 0, { NULL }, 0, 0, BACKEND_EPOLL };
+
+//one log record, in the ring and (for LOG_BINARY) on the output as well
+struct log_header
+{
+	uint32_t m_len; //text bytes that follow, LOG_PAD for the filler at the ring's end
+	uint8_t m_level; //one of log_level
+	uint8_t m_source; //reactor id, LOG_SOURCE_OTHER for any other thread
+	uint16_t m_pad;
+	uint64_t m_time; //CLOCK_REALTIME ns
+};
+
+//single-producer/single-consumer byte ring, one per logging thread
+//the owner appends at m_tail, the flusher consumes from m_head, positions
+//only ever grow and are taken modulo LOG_RING
+struct log_ring
+{
+	atomic_size_t m_head;
+	char m_pad[CACHE_LINE - sizeof(size_t)]; //producer and flusher on separate lines
+	atomic_size_t m_tail;
+	atomic_ulong m_dropped; //records lost because the ring was full
+	unsigned long m_reported; //m_dropped the flusher already warned about
+	int m_source;
+	unsigned char *m_buf;
+};
+
+//adds n to one of the calling reactor's counters; only the owner ever writes
+//them, so a relaxed load and store is enough and the metrics thread still
+//reads whole values
+#define METRIC_ADD(counter, n) atomic_store_explicit(&(counter), \
+	atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+
+//how often each slow consumer policy had to step in, also scraped live
+struct slow_consumer_stats
+{
+	atomic_ulong m_dropped;
+	atomic_ulong m_coalesced;
+	atomic_ulong m_disconnected;
+};
+
+//a reactor's live counters for the metrics endpoint, see METRIC_ADD
+//histogram bucket b counts values in [2^b, 2^(b+1)), 0 goes in bucket 0
+struct reactor_metrics
+{
+	atomic_ulong m_opened; //sessions, accepted or handed over
+	atomic_ulong m_closed;
+	atomic_ulong m_accepts;
+	atomic_ulong m_msgs_in; //frames read from clients
+	atomic_ulong m_msgs_out; //frames fully written to clients
+	atomic_ulong m_bytes_in;
+	atomic_ulong m_bytes_out;
+	atomic_ulong m_writes; //writev() and sendfile() calls to clients, or writevs handed to io_uring
+	atomic_ulong m_syscalls; //every syscall the loop makes to wait for or move client bytes
+	atomic_ulong m_streams; //messages clients streamed in chunks
+	atomic_ulong m_stream_bytes; //chunk bytes passed on to the rooms
+	atomic_ulong m_loop[METRIC_BUCKETS]; //ns spent on one batch of events
+	atomic_ulong m_loop_sum;
+	atomic_ulong m_depth[METRIC_BUCKETS]; //a queue's length right after an enqueue
+	atomic_ulong m_depth_sum;
+};
+
+//the text of one scrape, grown as it is written
+struct metrics_buf
+{
+	char *m_data;
+	size_t m_len;
+	size_t m_cap;
+};
+
+//one file of a room's message log: frames back to back, exactly as they
+//went on the wire, mapped for appending and sent from with sendfile()
+typedef struct segments
+{
+	atomic_int m_refs; //the room's log, its replay index and queued replays
+	int m_fd;
+	unsigned char *m_map; //m_size bytes, MAP_SHARED
+	size_t m_size;
+	size_t m_used; //bytes of whole frames, only grows while the room lock is held
+	uint32_t m_seq; //file name, segments are numbered in order
+} segment;
+
+//a buffer reads land in; long chat lines are broadcast straight out of it,
+//so every message pointing into it holds a reference and the last one frees it
+typedef struct rx_blocks
+{
+	atomic_int m_refs;
+	unsigned char m_data[]; //RX_BLOCK_CAP bytes
+} rx_block;
+
+//a message a client is streaming in chunks; every chunk passed on holds a
+//reference and, once freed, hands its bytes back to the sender as credit
+typedef struct streams
+{
+	atomic_int m_refs; //the sender while it streams, and every chunk
+	int m_reactor; //the sender's reactor, where the credit goes
+	uint64_t m_sender; //its session_handle
+	uint64_t m_id; //in front of every piece, unique across the cluster
+	//the rest is only touched by the sender's reactor
+	size_t m_bytes; //passed on so far
+	size_t m_pieces;
+	int m_ended; //the room has its newline (finished or cut at STREAM_MAX), the rest is dropped
+} stream;
+
+//one encoded frame, shared by every queue it sits on (on any reactor)
+//immutable once built, freed when the last reference is released
+typedef struct messages
+{
+	atomic_int m_refs;
+	uint16_t m_head; //sliced: bytes of m_data that go before the slice
+	uint16_t m_tail; //sliced: bytes of m_data that go after it
+	size_t m_len; //bytes of the frame, header included
+	//history replay: the bytes are m_len bytes at m_offset of this segment
+	//instead of m_data, and go to the socket with sendfile()
+	segment *m_segment;
+	off_t m_offset;
+	//sliced (a long chat line): the text is m_len - m_head - m_tail bytes at
+	//m_offset of this block, m_data only holds the frame around it
+	rx_block *m_block;
+	stream *m_stream; //a chunk of a streamed message, credited once freed
+#ifdef CHAT_TRACE
+	uint64_t m_t_read; //now_ns() stamps of the chat line, 0 for anything else
+	uint64_t m_t_parse;
+	uint64_t m_t_room;
+#endif
+	unsigned char m_data[]; //the frame exactly as it goes on the wire
+} message;
+
+struct clients;
+
+//header in front of every pool block, the caller's bytes follow it
+typedef struct pool_blocks
+{
+	struct pool_blocks *m_next; //free list link while the block is unused
+	uint32_t m_class; //size class, POOL_HEAP for a plain malloc()
+	uint32_t m_owner; //reactor whose pool the block was carved from
+} pool_block;
+
+//one size class of a reactor's pool
+//m_free belongs to the owner, blocks freed by other reactors are pushed
+//onto m_remote and taken back in one go when m_free runs dry
+struct pool_class
+{
+	pool_block *m_free;
+	size_t m_carved; //blocks cut from slabs so far
+	size_t m_in_use; //blocks handed out, less the ones back on m_free
+	_Atomic(pool_block *) m_remote;
+	char m_pad[CACHE_LINE - 2 * sizeof(void *) - 2 * sizeof(size_t)]; //remote frees stay off the next class
+};
+
+//one reactor's members of a room, only that reactor touches m_members
+//m_count is also read by the other reactors to skip empty shares
+struct room_share
+{
+	struct clients **m_members; //compact, order is not kept
+	size_t m_cap;
+	atomic_size_t m_count;
+	char m_pad[CACHE_LINE - sizeof(void *) - 2 * sizeof(size_t)]; //keeps shares off each other's cache line
+};
+
+//a frame that was replaced in its slot while a replay had the slot pinned
+struct scroll_retired
+{
+	struct scroll_retired *m_next;
+	message *m_msg; //holds the slot's reference
+};
+
+//one frame of a room's scrollback, written by the room's home reactor
+//and read by the replays on every reactor
+struct scroll_slot
+{
+	_Atomic(message *) m_msg; //holds a reference, NULL until the ring has gone round once
+	_Atomic(struct scroll_retired *) m_retired; //replaced frames for the last reader out to release
+	atomic_int m_readers; //replays taking a reference to m_msg right now
+	char m_pad[CACHE_LINE - 2 * sizeof(void *) - sizeof(int)]; //neighbouring slots are pinned independently
+};
+
+//a chat room, created on first /join and kept after it empties out
+typedef struct rooms
+{
+	char m_name[ROOM_NAME_SIZE];
+	uint32_t m_hash;
+	struct rooms *m_next; //next room in the same hash bucket
+	struct room_share *m_local; //one share per reactor
+	//what was said in the room, for the people who join later; only the
+	//room's home reactor (ROOM_HOME) records it, the others mail it lines
+	struct scroll_slot *m_scroll; //ring of the last config.scrollback broadcasts, line n in slot n % config.scrollback
+	atomic_ulong m_lines; //chat lines since the server started, stored once the line is in place
+	atomic_ulong m_writing; //stored before that, when a line starts replacing one m_scroll slots older
+	pthread_mutex_t m_lock; //the log is shared with the history thread and the replays
+	struct history *m_history; //NULL unless -H was given
+	//cluster membership, only kept up with -L or -J
+	atomic_size_t m_members; //this node's members, over every reactor
+	_Atomic uint64_t m_peers; //bit i is set while link i has members in the room
+	int m_announced; //link thread only: our peers were told we have members
+} room;
+
+//where the last config.history_replay frames of a room sit in its log
+struct history_entry
+{
+	segment *m_segment; //holds a reference
+	size_t m_offset;
+	size_t m_len;
+};
+
+//a room's message log, guarded by its room's m_lock
+//the history thread does everything that touches the disk (opening the
+//log, keeping a spare segment ready, trimming a full one), a reactor only
+//copies frames into mapped memory and holds them back while it cannot
+struct history
+{
+	int m_opened; //segments looked up on disk, m_failed if that went wrong
+	int m_failed; //the disk let us down, no more history for this room
+	int m_dirty; //appended to since the last sync
+	segment *m_current; //being appended to
+	segment *m_spare; //the next segment, opened ahead for when m_current is full
+	segment *m_full; //the segment m_spare took over from, for the history thread to trim
+	message **m_held; //frames that came while there was no segment for them, oldest first
+	size_t m_held_count;
+	struct history_entry *m_recent; //ring of config.history_replay entries
+	size_t m_recent_next; //slot the next entry goes in
+	size_t m_recent_count;
+	room *m_room;
+	struct history *m_next_log; //list of every room's log, walked by the history thread
+};
+
+//what the room logs did, per reactor
+struct history_stats
+{
+	unsigned long m_appended;
+	uint64_t m_bytes;
+	unsigned long m_replays; //joins that got history
+	unsigned long m_replayed; //frames they got
+	unsigned long m_lost; //frames not logged because HISTORY_HELD were already waiting
+};
+
+//how the in-memory scrollback did, per reactor
+struct scrollback_stats
+{
+	unsigned long m_hits; //joins it could serve completely
+	unsigned long m_misses; //joins that needed more than it had
+	long m_frames; //frames added less frames evicted here, the sum over reactors is what is held
+	long m_bytes; //the same in message bytes
+};
+
+//first record of a handoff, the listening sockets travel with it
+struct handoff_header
+{
+	uint32_t m_magic; //HANDOFF_MAGIC
+	uint32_t m_listeners; //descriptors attached
+};
+
+//one client in a handoff, its socket travels with the record, followed by
+//the name, the room name, the partial inbound frame and the unsent output
+struct handoff_session
+{
+	uint32_t m_state; //one of client_state, HANDOFF_END after the last client
+	uint32_t m_name_len;
+	uint32_t m_room_len; //0 before the handshake
+	uint32_t m_in_len;
+	uint32_t m_credited; //FRAME_CREDIT total the client may count on
+	uint64_t m_out_len; //queued frames, less what was already written
+};
+
+//what a reactor did while shutting down
+struct shutdown_stats
+{
+	unsigned long m_flushed; //frames written after the shutdown began
+	unsigned long m_cut_clients; //still had output when the drain deadline passed
+	unsigned long m_cut_frames; //frames those clients never got
+};
 
-// struct clients which will store the info about 
+// struct clients which will store the info about
 // each client including socket, name, buffer, etc
 typedef struct clients
 {
 	int m_fd;
-	int m_index; //index that the client is located in the clients[] array
-	pthread_t m_thread; //thread for the client
-	char m_buffer[BUFFER_SIZE]; //buffer for the client, read/write
-	char m_name[BUFFER_SIZE]; //name of user will be stored here
+	int m_index; //slot of the client in the session slab
+	uint32_t m_gen; //bumped every time the slot is released
+	int m_next_free; //next slot on the free list while unused
+	int m_state; //one of client_state
+	char *m_name; //name of user, points at m_name_inline unless it is long
+	char m_name_inline[NAME_INLINE];
+	struct frame_reader m_in; //a frame split across reads, m_buf is NULL while there is none
+	room *m_room; //room the client talks in, NULL before the handshake
+	size_t m_room_slot; //index in its reactor's share of m_room, for O(1) removal
+	message **m_queue; //ring of messages waiting for the socket to become writable
+	size_t m_q_head; //slot of the oldest queued message
+	size_t m_q_count;
+	size_t m_q_cap; //starts at QUEUE_INITIAL, doubles up to config.queue_depth
+	size_t m_q_sent; //bytes of the oldest message already written
+	int m_blocked; //last write hit EAGAIN, wait for EPOLLOUT (io_uring: writes are in flight)
+	int m_pending; //on the reactor's flush list
+	int m_dying; //broken or evicted, dropped at the end of this loop pass
+	int m_sends; //io_uring writevs in flight
+	size_t m_q_busy; //frames at the head of the queue they are writing
+	stream *m_stream; //the message it is streaming, NULL between messages
+	uint32_t m_owed; //chunk bytes taken in but not credited back yet
+	uint32_t m_credited; //running total sent in FRAME_CREDIT, wraps
 } session;
 
-//acts like the FD array mentioned in supplamental slides
-session clients[MAX_CLIENT];
+//a client is named by (generation << 32 | slot), a handle to a slot
+//that has since been reused no longer matches and resolves to NULL
+typedef uint64_t session_handle;
+
+//-i uring: one writev in flight; it holds its own references, so the
+//client may be closed and its queue cleared before the kernel is done
+struct uring_send
+{
+	session_handle m_client;
+	size_t m_count;
+	int m_iov_count; //a sliced frame takes three
+	message *m_msgs[FLUSH_IOV];
+	struct iovec m_iov[FLUSH_PARTS];
+};
+
+//-i uring: a reactor's rings, shared with the kernel, and the receive
+//buffers it hands out; only the owning reactor touches them
+struct uring
+{
+	int m_fd;
+	unsigned m_entries;
+	_Atomic unsigned *m_sq_head; //moved by the kernel as it takes requests
+	_Atomic unsigned *m_sq_tail;
+	unsigned *m_sq_mask;
+	unsigned *m_sq_array;
+	struct io_uring_sqe *m_sqes;
+	_Atomic unsigned *m_cq_head;
+	_Atomic unsigned *m_cq_tail; //moved by the kernel as it posts completions
+	unsigned *m_cq_mask;
+	struct io_uring_cqe *m_cqes;
+	struct io_uring_buf_ring *m_bufs; //buffer group 0, the recvs pick from it
+	unsigned char *m_buf_mem; //URING_BUFFERS buffers of URING_BUF_SIZE
+	uint16_t m_buf_tail;
+	size_t m_ops; //requests that will still post a completion
+	int m_accepting; //the multishot accept is armed
+};
+
+//what a mail asks the receiving reactor to do
+enum mail_kind
+{
+	MAIL_BROADCAST,	//deliver m_msg to our members of m_room
+	MAIL_DIRECT,	//deliver m_msg to the session m_to, if it is still there
+	MAIL_REMOTE,	//m_msg was said in m_room on another node, record it and fan it out
+	MAIL_RECORD,	//m_msg was said in m_room on another reactor, record it (we are the room's home)
+	MAIL_FORWARD,	//to the link thread: send m_msg to the peers with members in m_room
+	MAIL_INTEREST,	//to the link thread: m_room gained its first or lost its last member here
+	MAIL_CREDIT	//m_credit bytes of the session m_to's chunks reached everyone
+};
+
+//one item in a reactor's mailbox, allocated by the sender and freed by
+//the receiver once handled
+typedef struct mails
+{
+	_Atomic(struct mails *) m_next;
+	int m_kind; //one of mail_kind
+	uint32_t m_credit; //MAIL_CREDIT only
+	room *m_room;
+	session_handle m_to; //MAIL_DIRECT only
+	message *m_msg; //the sender's reference travels with the mail
+	uint64_t m_posted; //CLOCK_MONOTONIC ns, for the latency stats
+} mail;
+
+//Vyukov's intrusive multi-producer/single-consumer queue
+//producers only touch m_tail (one atomic exchange each), the consumer
+//owns m_head; m_stub keeps the list from ever being empty
+struct mpsc_queue
+{
+	_Atomic(mail *) m_tail;
+	char m_pad[CACHE_LINE - sizeof(mail *)]; //producers and consumer on separate lines
+	mail *m_head;
+	mail m_stub;
+};
+
+//a reactor's inbox: the queue plus the eventfd that wakes it up
+//m_armed is set while the owner may be asleep in epoll_wait, the first
+//producer to see it set pays for the eventfd write, the rest skip it
+struct mailbox
+{
+	struct mpsc_queue m_queue;
+	atomic_int m_armed;
+	int m_wake_fd;
+};
+
+//time mails spend between post and delivery
+struct latency_stats
+{
+	unsigned long m_count;
+	uint64_t m_total; //ns
+	uint64_t m_max; //ns
+	unsigned long m_buckets[LATENCY_BUCKETS]; //bucket b holds [2^b, 2^(b+1)) ns
+};
+
+//one event loop thread and everything only it touches
+typedef struct reactors
+{
+	int m_id;
+	pthread_t m_thread;
+	int m_epfd; //owns the listener, the eventfd and every client socket
+	struct uring *m_ring; //-i uring instead of m_epfd, NULL with epoll
+	int m_listen_fd; //this reactor's SO_REUSEPORT listener
+	//the session slab, acts like the FD array mentioned in supplamental slides
+	//grows SLAB_CHUNK sessions at a time, chunks never move once allocated
+	session **m_chunks;
+	size_t m_chunk_count;
+	size_t m_slot_count; //slots handed out so far, m_chunk_count * SLAB_CHUNK
+	size_t m_active_count; //slots currently holding a client
+	size_t m_max_clients; //this reactor's part of config.max_clients
+	int m_free_head; //first unused slot
+	int m_accept_waiting; //the slab was full, the backlog has clients waiting
+	//clients to drop once the current event batch is done, dropping them on the
+	//spot would recurse (the leave notice can break another client's socket)
+	session_handle *m_reap_list;
+	size_t m_reap_count;
+	size_t m_reap_cap;
+	//clients with frames queued since their last flush, written in one go
+	//at the end of the loop pass or when the -w timer fires
+	session_handle *m_flush_list;
+	size_t m_flush_count;
+	size_t m_flush_cap;
+	int m_flush_fd; //timerfd armed by the first frame of a window, -w only
+	struct mailbox m_mailbox; //other reactors post here
+	//every client reads into this buffer, only a leftover partial frame
+	//is moved into a buffer of the client's own
+	struct frame_reader m_scratch;
+	rx_block *m_rx; //the block m_scratch reads into, it moves on past sliced lines
+	size_t m_rx_used; //bytes of m_rx that sliced lines may still point at
+	//the frame being handled, if it may be sliced
+	rx_block *m_slice_block;
+	const char *m_slice;
+	size_t m_slice_len;
+	char m_text[BUFFER_SIZE]; //payload of the frame being handled, nul-terminated
+	struct pool_class m_pool[POOL_CLASSES];
+	size_t m_pool_bytes; //slab memory taken from malloc()
+	unsigned long m_pool_heap; //requests too big for the pool
+	size_t m_session_bytes; //queues, partial frames and long names held by sessions
+	struct history_stats m_history;
+	struct scrollback_stats m_scroll;
+	int m_phase; //the shutdown_phase this reactor has acted on
+	uint64_t m_deadline; //CLOCK_MONOTONIC ns, when draining gives up
+	struct shutdown_stats m_shutdown;
+	struct slow_consumer_stats m_slow;
+	struct latency_stats m_mail_latency;
+	struct reactor_metrics m_metrics;
+#ifdef CHAT_TRACE
+	uint64_t m_t_read; //when the read() that brought the frame in m_text returned
+	uint64_t m_t_parse; //when that frame was decoded
+	struct latency_stats m_trace[TRACE_STAGES];
+#endif
+} reactor;
+
+//one taken name in the name index, says where its owner lives
+typedef struct nicks
+{
+	uint32_t m_hash;
+	int m_reactor;
+	session_handle m_handle; //resolved by that reactor only
+	struct nicks *m_next; //next name in the same bucket
+	char m_name[NICK_SIZE];
+} nick;
+
+//one connection to another node, only the link thread touches it
+struct link
+{
+	int m_fd; //-1 while the slot is free
+	uint32_t m_gen; //bumped when the slot is freed, stale epoll events are told apart
+	int m_dial; //index in config.link_to we dialed, -1 if the peer dialed us
+	int m_connecting; //non-blocking connect() still in progress
+	int m_ready; //the peer's hello arrived
+	int m_broken; //fell LINK_OUT_MAX behind, closed at the end of the pass
+	uint64_t m_node; //the peer's node id
+	struct frame_reader m_in;
+	unsigned char *m_out; //frames gathered for the next write
+	size_t m_out_len;
+	size_t m_out_cap;
+};
+
+//every reactor, config.reactors of them
+reactor *reactors;
+//the reactor the calling thread runs
+__thread reactor *current;
+//room registry, chained hash table keyed by room name
+//only /join takes the lock, broadcasts go through the client's room pointer
+pthread_mutex_t room_lock = PTHREAD_MUTEX_INITIALIZER;
+room **room_table;
+size_t room_buckets;
+size_t room_total;
+//name index, chained hash table keyed by user name
+//handshakes and renames write it, /msg only reads it
+pthread_rwlock_t nick_lock = PTHREAD_RWLOCK_INITIALIZER;
+nick **nick_table;
+size_t nick_buckets;
+size_t nick_total;
+//every thread's log ring, a slot is filled in the first time its thread logs
+_Atomic(struct log_ring *) log_rings[LOG_MAX_RINGS];
+atomic_int log_ring_count;
+__thread struct log_ring *log_local;
+pthread_t log_thread;
+atomic_int log_stopping;
+//output batch, only the flusher thread touches it
+unsigned char log_batch[LOG_BATCH];
+size_t log_batch_len;
+//every room's log, newest first, never shrinks
+_Atomic(struct history *) history_list;
+int history_wake_fd = -1; //eventfd, a reactor needs a log opened or a spare segment
+pthread_t history_thread;
+atomic_int history_stopping;
+unsigned long history_syncs;
+//when the first signal arrived and when the last reactor was done, CLOCK_MONOTONIC ns
+uint64_t shutdown_started;
+uint64_t shutdown_finished;
+//-U: where our replacement connects, and the connection once it has
+int handoff_listen_fd = -1;
+int handoff_peer = -1;
+//listening sockets inherited from the server we replace
+int handoff_listeners[MAX_REACTORS];
+int handoff_listener_count;
+//what went over to the replacement
+size_t handoff_sessions;
+uint64_t handoff_bytes;
+//-M: the metrics endpoint and the thread that answers it
+int metrics_fd = -1;
+pthread_t metrics_thread;
+atomic_int metrics_stopping;
+//-L/-J: this node, its links to the others and the thread that runs them
+int links_on;
+uint64_t link_node; //tells the nodes of a cluster apart, and a node from itself
+struct link links[LINK_MAX_PEERS]; //slot i is bit i of a room's m_peers
+uint64_t link_dialed_node[LINK_MAX_PEERS]; //node id behind each config.link_to, once known
+struct mailbox link_box; //the reactors post here
+int link_epfd;
+int link_listen_fd = -1;
+pthread_t link_thread;
+atomic_int link_stopping;
+unsigned long link_forwarded, link_writes, link_received;
+size_t link_rooms; //rooms created because a peer joined them, link thread only
+//numbers the messages streamed through this node
+_Atomic uint64_t stream_count;
 
 //list of functions used in server.c
-void init_clients();
-int find_opening_client_spot();
-void *client_handler(void * client);
-void send_to_clients(session * sender_index);
-void signalhandler(int sig);
+void parse_options(int argc, char * argv[]);
+void usage(const char * prog);
+void init_reactors();
+void *reactor_main(void * arg);
+struct uring *uring_init();
+void uring_main();
+struct io_uring_sqe *uring_sqe(unsigned need);
+void uring_enter(int wait, int64_t timeout);
+void uring_reap();
+void uring_reap_sends();
+void uring_complete(struct io_uring_cqe * cqe);
+void uring_poll(int fd, int op);
+void uring_cancel(uint64_t data);
+void uring_quiesce();
+void uring_accept();
+void uring_accepted(int fd);
+void uring_recv(session * client);
+void uring_received(struct io_uring_cqe * cqe);
+void uring_buffer_return(unsigned bid);
+session *uring_client(uint64_t data);
+void uring_flush(session * client);
+void uring_sent(struct io_uring_cqe * cqe);
+int open_listener();
+void mpsc_init(struct mpsc_queue * q);
+void mpsc_push(struct mpsc_queue * q, mail * m);
+mail *mpsc_pop(struct mpsc_queue * q);
+void mailbox_post(struct mailbox * box, int kind, room * where, session_handle to, message * msg, uint32_t credit);
+void post_to_reactor(int target, int kind, room * where, session_handle to, message * msg);
+void post_to_link(int kind, room * where, message * msg);
+void drain_mailbox();
+uint64_t now_ns();
+void record_latency(struct latency_stats * stats, uint64_t ns);
+uint64_t latency_percentile(struct latency_stats * stats, double pct);
+#ifdef CHAT_TRACE
+void trace_record(int stage, uint64_t since);
+message *message_untraced(message * msg);
+#endif
+session *session_at(size_t index);
+session_handle session_handle_of(session * client);
+session *session_lookup(session_handle handle);
+session *session_alloc();
+session *client_open(int fd);
+void session_free(session * client);
+int grow_sessions();
+int set_nonblocking(int fd);
+void accept_clients();
+void on_client_readable(session * client);
+void client_received(session * client, const unsigned char * data, size_t len);
+int client_frames(session * client, struct frame_reader * in);
+void on_client_writable(session * client);
+void on_client_message(session * client, int type, const char * text);
+void keep_partial_frame(session * client, struct frame_reader * in);
+struct frame_reader *rx_reader(session * client);
+rx_block *rx_alloc();
+rx_block *rx_of(unsigned char * buf);
+void rx_release(rx_block * b);
+void set_name(session * client, const char * name);
+void free_name(session * client);
+int valid_name(const char * name);
+int nick_claim(const char * name, session * client);
+void nick_release(const char * name, session * client);
+int nick_find(const char * name, int * reactor_id, session_handle * handle);
+void nick_grow();
+void rename_client(session * client, const char * name);
+void send_direct(session * sender, const char * name, size_t name_len, const char * text);
+void close_client(session * client);
+void drop_client(session * client);
+void schedule_drop(session * client);
+void reap_clients();
+void flush_later(session * client);
+void flush_pending();
+message *message_alloc(size_t len);
+message *message_create(int type, const char * text);
+message *message_printf(int type, const char * format, ...);
+message *message_slice(int type, const void * head, size_t head_len, rx_block * b, const char * text, size_t len,
+	const char * tail);
+int message_iov(message * msg, struct iovec * iov, size_t skip);
+void message_read(message * msg, size_t at, unsigned char * out, size_t len);
+void *pool_alloc(size_t size);
+void pool_free(void * ptr);
+void pool_refill(struct pool_class * pc, uint32_t c);
+int grow_queue(session * client);
+void message_release(message * msg);
+void enqueue_message(session * client, message * msg);
+int make_queue_room(session * client);
+int coalesce_queue(session * client, size_t first);
+void pop_sent(session * client, size_t n);
+void print_stats();
+void clear_queue(session * client);
+void queue_to_client(session * client, int type, const char * text);
+void flush_client(session * client);
+unsigned char *message_bytes(message * msg);
+const unsigned char *message_payload(message * msg, int * type, size_t * len);
+int message_is_chunk(message * msg);
+void send_to_clients(session * sender, const char * text);
+void stream_piece(session * client, int last, rx_block * b, const char * piece, size_t len);
+void stream_send(session * client, int type, rx_block * b, const char * piece, size_t len);
+void stream_end(session * client);
+void stream_release(stream * s);
+void credit_client(session * client, uint32_t bytes);
+uint32_t room_hash(const char * name);
+room *room_find(const char * name, int create);
+void room_grow();
+void room_join(session * client, room * target);
+void room_leave(session * client);
+void change_room(session * client, const char * name);
+void broadcast_to_room(room * target, session * except, message * msg);
+void deliver_to_node(room * target, session * except, message * msg);
+void deliver_local(room * target, session * except, message * msg);
+int shutdown_signals();
+void shutdown_wait(int sfd);
+void shutdown_advance(int phase);
+void shutdown_step();
+void shutdown_cut_off();
+void handoff_listen();
+int handoff_connect();
+void handoff_take(int sd);
+void handoff_give();
+int handoff_send(int sd, const void * buf, size_t len, const int * fds, int nfds);
+int handoff_recv(int sd, void * buf, size_t len, int * fds, int max);
+int write_full(int fd, const void * buf, size_t len);
+int read_full(int fd, void * buf, size_t len);
+void metrics_start();
+void metrics_stop();
+void *metrics_main(void * arg);
+void metrics_scrape(struct metrics_buf * out);
+void metrics_printf(struct metrics_buf * out, const char * format, ...);
+void metrics_histogram(struct metrics_buf * out, const char * name, const char * labels, unsigned long * buckets,
+	int first, int last, double scale, int integral, double sum);
+int metric_bucket(uint64_t value);
+void link_start();
+void link_stop();
+void *link_main(void * arg);
+void link_drain();
+void link_accept();
+void link_dial_all();
+void link_dial(int dial);
+struct link *link_open(int fd, int dial, int connecting);
+void link_close(struct link * l);
+void link_connected(struct link * l);
+void link_read(struct link * l);
+void link_frame(struct link * l, struct frame * f);
+void link_hello(struct link * l, struct frame * f);
+void link_deliver(struct frame * f);
+void link_forward(room * target, message * msg);
+void link_announce(room * target);
+void link_queue(struct link * l, int type, const void * payload, size_t len);
+void link_flush(struct link * l);
+void log_write(int level, const char * format, ...);
+struct log_ring *log_attach();
+void log_start();
+void log_stop();
+void *log_main(void * arg);
+size_t log_drain();
+void log_emit(struct log_header * h, const char * text);
+void log_flush_batch();
+void history_start();
+void history_stop();
+void *history_main(void * arg);
+void history_add(struct history * h);
+void history_wake();
+void history_prepare(struct history * h);
+void history_sync(struct history * h);
+int history_open(struct history * h);
+int history_room_name(char * out, const char * dir);
+segment *segment_open(struct history * h, uint32_t seq, int current);
+void segment_trim(struct history * h, segment * seg);
+void segment_release(segment * seg);
+void history_scan(struct history * h, segment * seg);
+void history_remember(struct history * h, segment * seg, size_t offset, size_t len);
+void history_append(struct history * h, message * msg);
+int history_write(struct history * h, message * msg);
+void history_catch_up(struct history * h);
+size_t history_collect(struct history * h, message ** batch, size_t want, size_t * lines);
+void room_record(room * target, message * msg);
+void room_replay(session * client, room * target, size_t want);
+void scrollback_add(room * target, message * msg, unsigned long seq);
+void scrollback_reap(struct scroll_slot * slot);
+void history_path(char * out, room * target, uint32_t seq);
+int history_failed(struct history * h, const char * what);
 void client_is_leaving(session * client_leaving);
 void client_has_entered(session * client_joining);
 
-int main()
+int main(int argc, char * argv[])
+{
+	int i, sfd, handoff = -1;
+	parse_options(argc, argv);
+	//before any thread exists, so they all inherit the blocked mask
+	sfd = shutdown_signals();
+	log_start();
+	//a client vanishing mid-write must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+	//a server already running on the handoff socket passes us its sockets
+	if (config.handoff_path != NULL)
+		handoff = handoff_connect();
+	init_reactors();
+	//adopted clients join their rooms, the link thread hears about it
+	if (config.link_port != 0 || config.link_dials > 0)
+		link_start();
+	if (handoff != -1)
+		handoff_take(handoff);
+	if (config.handoff_path != NULL)
+		handoff_listen();
+	if (config.history_dir != NULL)
+		history_start();
+	if (config.metrics_port != 0)
+		metrics_start();
+	/* listen for clients */
+	log_write(LOG_INFO, ">>Server is now listening for up to %zu clients on %d reactors (%s)", config.max_clients, config.reactors,
+		config.backend == BACKEND_URING ? "io_uring" : "epoll");
+	for (i = 0; i < config.reactors; i++)
+	{
+		if (pthread_create(&reactors[i].m_thread, NULL, reactor_main, &reactors[i]) != 0)
+		{
+			perror("Error Creating Thread\n");
+			exit(1);
+		}
+	}
+	shutdown_wait(sfd);
+	for (i = 0; i < config.reactors; i++)
+		pthread_join(reactors[i].m_thread, NULL);
+	if (links_on)
+		link_stop();
+	if (config.metrics_port != 0)
+		metrics_stop();
+	//the logs are trimmed before the replacement may append to them
+	if (config.history_dir != NULL)
+		history_stop();
+	if (handoff_peer != -1)
+		handoff_give();
+	shutdown_finished = now_ns();
+	log_stop();
+	print_stats();
+	return (0);
+}
+//sets up every reactor before any thread starts, the rings have to exist
+//before anyone can post into them
+void init_reactors()
+{
+	struct epoll_event ev;
+	struct timespec ts;
+	int i;
+	if ((reactors = calloc(config.reactors, sizeof(reactor))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	//stream ids must not repeat across a handoff, so they do not start at 0
+	clock_gettime(CLOCK_REALTIME, &ts);
+	atomic_init(&stream_count, ((uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec) ^ ((uint64_t)getpid() << 32));
+	for (i = 0; i < config.reactors; i++)
+	{
+		reactors[i].m_id = i;
+		reactors[i].m_free_head = EMPTY_CLIENT;
+		reactors[i].m_max_clients = (config.max_clients + config.reactors - 1) / config.reactors;
+		mpsc_init(&reactors[i].m_mailbox.m_queue);
+		if ((reactors[i].m_mailbox.m_wake_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+		{
+			perror("Server Error: eventfd failed");
+			exit(1);
+		}
+		//inherited listeners keep their backlog, so nobody waiting is lost
+		reactors[i].m_listen_fd = i < handoff_listener_count ? handoff_listeners[i] : open_listener();
+		reactors[i].m_rx = rx_alloc();
+		reactors[i].m_scratch.m_buf = reactors[i].m_rx->m_data;
+		reactors[i].m_scratch.m_cap = RX_BLOCK_CAP;
+		reactors[i].m_flush_fd = -1;
+		if (config.flush_window > 0 && (reactors[i].m_flush_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+		{
+			perror("Server Error: Flush timer failed");
+			exit(1);
+		}
+		//the reactor arms its accept and polls itself once it runs
+		reactors[i].m_epfd = -1;
+		if (config.backend == BACKEND_URING)
+		{
+			reactors[i].m_ring = uring_init();
+			continue;
+		}
+		if ((reactors[i].m_epfd = epoll_create1(0)) == -1)
+		{
+			perror("Server Error: epoll_create failed");
+			exit(1);
+		}
+		//clients are tagged with their handle, the listener and eventfd with their own tags
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.u64 = LISTENER_HANDLE;
+		if (epoll_ctl(reactors[i].m_epfd, EPOLL_CTL_ADD, reactors[i].m_listen_fd, &ev) == -1)
+		{
+			perror("Server Error: epoll_ctl failed");
+			exit(1);
+		}
+		ev.data.u64 = WAKE_HANDLE;
+		if (epoll_ctl(reactors[i].m_epfd, EPOLL_CTL_ADD, reactors[i].m_mailbox.m_wake_fd, &ev) == -1)
+		{
+			perror("Server Error: epoll_ctl failed");
+			exit(1);
+		}
+		ev.data.u64 = FLUSH_HANDLE;
+		if (reactors[i].m_flush_fd != -1 && epoll_ctl(reactors[i].m_epfd, EPOLL_CTL_ADD, reactors[i].m_flush_fd, &ev) == -1)
+		{
+			perror("Server Error: Flush timer failed");
+			exit(1);
+		}
+	}
+	//the old server ran more reactors than we do
+	for (; i < handoff_listener_count; i++)
+		close(handoff_listeners[i]);
+}
+//creates one SO_REUSEPORT listener on config.port, every reactor has its own
+//and the kernel load balances new connections between them
+int open_listener()
 {
-	struct sockaddr_in server_addr = { AF_INET, htons(SERVER_PORT) };
-	struct sockaddr_in client_addr = { AF_INET };
-	length = sizeof(client_addr);
-	//initlize basic client info
-	init_clients();
+	struct sockaddr_in server_addr = { AF_INET, htons(config.port) };
+	int sd;
 	/* create a stream socket */
 	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
 	{
@@ -94,8 +1211,9 @@ int main()
 	}
 	//variable needed for setsokopt call
 	int setsock = 1;
-	//assists in using address
-	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &setsock, sizeof(setsock)) == -1)
+	//assists in using address, and lets every reactor bind the same port
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &setsock, sizeof(setsock)) == -1
+		|| setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &setsock, sizeof(setsock)) == -1)
 	{
 		perror("Server Error: Setsockopt failed");
 		exit(1);
@@ -106,240 +1224,4643 @@ int main()
 		perror("Server Error: Bind Failed");
 		exit(1);
 	}
-	//initilize the signal handler
-	signal(SIGINT, signalhandler);
-	/* listen for clients */
-	printf(">>Server is now listening for up to 10 clients\n");
-	if (listen(sd, 10) == -1)
+	if (listen(sd, config.backlog) == -1)
 	{
 		perror("Server Error: Listen failed");
 		exit(1);
 	}
-	while (exit_flag != 1)
+	if (set_nonblocking(sd) == -1)
+	{
+		perror("Server Error: Non-blocking listen socket failed");
+		exit(1);
+	}
+	return sd;
+}
+//one event loop thread
+void *reactor_main(void * arg)
+{
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t wakeups, now, busy;
+	int i, n, timeout;
+	current = arg;
+	if (current->m_ring != NULL)
+	{
+		uring_main();
+		return NULL;
+	}
+	for (;;)
 	{
-		int opening;
-		//only one thread in this section at a time, prevents race cond. for client opening, etc
-		pthread_mutex_lock(&accept_mutex);
-		if ((opening = find_opening_client_spot()) != EMPTY_CLIENT)
+		//about to sleep: let producers know they need to wake us, then pick up
+		//anything that was posted before they could have seen the flag
+		atomic_store(&current->m_mailbox.m_armed, 1);
+		drain_mailbox();
+		//the pass is over, everyone gets what it queued for them; with -w
+		//the timer does that, unless the server is going down
+		if (config.flush_window == 0 || current->m_phase != SHUTDOWN_NONE)
+			flush_pending();
+		timeout = -1;
+		if (current->m_phase == SHUTDOWN_DRAIN)
 		{
-			//if there's an opening, accept the client
-			if ((clients[opening].m_fd = accept(sd, (struct sockaddr*)&client_addr, &length)) == -1)
+			//everyone has gone, or the deadline passed
+			if (current->m_active_count == 0)
+				break;
+			if ((now = now_ns()) >= current->m_deadline)
 			{
-				if (exit_flag != 1) //prevents some extraneous output
-				{
-					perror("Server Error: Accepting issue");
-					exit(1);
-				}
+				shutdown_cut_off();
+				break;
 			}
-			else
+			timeout = (current->m_deadline - now + 999999) / 1000000;
+		}
+		n = epoll_wait(current->m_epfd, events, MAX_EVENTS, timeout);
+		atomic_store_explicit(&current->m_mailbox.m_armed, 0, memory_order_relaxed);
+		METRIC_ADD(current->m_metrics.m_syscalls, 1);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("Server Error: epoll_wait failed");
+			exit(1);
+		}
+		busy = now_ns();
+		for (i = 0; i < n; i++)
+		{
+			session *client;
+			if (events[i].data.u64 == LISTENER_HANDLE)
 			{
-				//once client is accepted, create a thread for the client
-				if (pthread_create(&(clients[opening].m_thread), NULL, &client_handler, &(clients[opening].m_index)) != 0)
-				{
-					perror("Error Creating Thread\n");
-					exit(1);
-				}
+				accept_clients();
+				continue;
+			}
+			if (events[i].data.u64 == WAKE_HANDLE)
+			{
+				//another reactor posted to our mailbox
+				read(current->m_mailbox.m_wake_fd, &wakeups, sizeof(wakeups));
+				METRIC_ADD(current->m_metrics.m_syscalls, 1);
+				drain_mailbox();
+				continue;
+			}
+			if (events[i].data.u64 == FLUSH_HANDLE)
+			{
+				//the oldest pending frame has waited config.flush_window
+				read(current->m_flush_fd, &wakeups, sizeof(wakeups));
+				METRIC_ADD(current->m_metrics.m_syscalls, 1);
+				flush_pending();
+				continue;
 			}
+			//a client closed earlier in this batch may still have events queued,
+			//its handle is stale even if the slot was handed to someone new
+			if ((client = session_lookup(events[i].data.u64)) == NULL)
+				continue;
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				on_client_readable(client);
+			if (client->m_fd != EMPTY_CLIENT && (events[i].events & EPOLLOUT))
+				on_client_writable(client);
 		}
-		pthread_mutex_unlock(&accept_mutex);
+		reap_clients();
+		//spots freed up while the backlog was waiting on us
+		if (current->m_accept_waiting && current->m_active_count < current->m_max_clients)
+			accept_clients();
+		if (current->m_phase != atomic_load(&shutdown_phase))
+			shutdown_step();
+		//every socket stays open for the new server
+		if (current->m_phase == SHUTDOWN_HANDOFF)
+			break;
+		busy = now_ns() - busy;
+		METRIC_ADD(current->m_metrics.m_loop[metric_bucket(busy)], 1);
+		METRIC_ADD(current->m_metrics.m_loop_sum, busy);
 	}
-	return (0);
+	return NULL;
 }
-//initilizes some basic client info
-//m_index indicates the location of the client in the clients[] array
-void init_clients()
+//-i uring: maps a ring for one reactor, with its receive buffers registered
+//as provided buffer group 0 (Linux 5.19 or later)
+struct uring *uring_init()
 {
-	int i;
-	for (i = 0; i < MAX_CLIENT; i++)
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct uring *u;
+	unsigned char *ring;
+	size_t size;
+	unsigned i;
+	memset(&p, 0, sizeof(p));
+	//a multishot recv can post many completions for one submission
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_ENTRIES * 4;
+	if ((u = calloc(1, sizeof(struct uring))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	if ((u->m_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) == -1)
+	{
+		perror("Server Error: io_uring_setup failed");
+		exit(1);
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
 	{
-		clients[i].m_index = i;
-		clients[i].m_fd = EMPTY_CLIENT;
+		fprintf(stderr, "Server Error: io_uring is too old on this kernel, use -i epoll\n");
+		exit(1);
+	}
+	//both rings share one mapping
+	size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->m_fd, IORING_OFF_SQ_RING);
+	u->m_sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		u->m_fd, IORING_OFF_SQES);
+	//page aligned, the kernel maps it too
+	u->m_bufs = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->m_buf_mem = malloc((size_t)URING_BUFFERS * URING_BUF_SIZE);
+	if (ring == MAP_FAILED || u->m_sqes == MAP_FAILED || u->m_bufs == MAP_FAILED || u->m_buf_mem == NULL)
+	{
+		perror("Server Error: io_uring mmap failed");
+		exit(1);
+	}
+	u->m_entries = p.sq_entries;
+	u->m_sq_head = (_Atomic unsigned *)(ring + p.sq_off.head);
+	u->m_sq_tail = (_Atomic unsigned *)(ring + p.sq_off.tail);
+	u->m_sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+	u->m_sq_array = (unsigned *)(ring + p.sq_off.array);
+	u->m_cq_head = (_Atomic unsigned *)(ring + p.cq_off.head);
+	u->m_cq_tail = (_Atomic unsigned *)(ring + p.cq_off.tail);
+	u->m_cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+	u->m_cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->m_bufs;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, u->m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		perror("Server Error: io_uring buffer ring failed");
+		exit(1);
+	}
+	for (i = 0; i < URING_BUFFERS; i++)
+	{
+		u->m_bufs->bufs[i].addr = (uintptr_t)(u->m_buf_mem + (size_t)i * URING_BUF_SIZE);
+		u->m_bufs->bufs[i].len = URING_BUF_SIZE;
+		u->m_bufs->bufs[i].bid = i;
 	}
+	u->m_buf_tail = URING_BUFFERS;
+	atomic_store_explicit((_Atomic uint16_t *)&u->m_bufs->tail, u->m_buf_tail, memory_order_release);
+	return u;
 }
-//used to determine if there is an opening for a new client
-// -1 -> there is no opening
-// any number greater than -1 indicates the index in the clients[]
-// that has an opening
-int find_opening_client_spot()
+//-i uring: reactor_main()'s loop with completions instead of readiness
+//events; each pass submits what it queued and sleeps in the same call
+void uring_main()
 {
-	int i;
-	for (i = 0; i < MAX_CLIENT; i++)
+	uint64_t now, busy;
+	int64_t timeout;
+	uring_accept();
+	uring_poll(current->m_mailbox.m_wake_fd, URING_WAKE);
+	if (current->m_flush_fd != -1)
+		uring_poll(current->m_flush_fd, URING_FLUSH);
+	for (;;)
 	{
-		if (clients[i].m_fd == EMPTY_CLIENT)
+		atomic_store(&current->m_mailbox.m_armed, 1);
+		drain_mailbox();
+		if (config.flush_window == 0 || current->m_phase != SHUTDOWN_NONE)
+			flush_pending();
+		timeout = -1;
+		if (current->m_phase == SHUTDOWN_DRAIN)
+		{
+			if (current->m_active_count == 0)
+				break;
+			if ((now = now_ns()) >= current->m_deadline)
+			{
+				shutdown_cut_off();
+				break;
+			}
+			timeout = current->m_deadline - now;
+		}
+		uring_enter(1, timeout);
+		atomic_store_explicit(&current->m_mailbox.m_armed, 0, memory_order_relaxed);
+		busy = now_ns();
+		uring_reap();
+		reap_clients();
+		//spots freed up while accepting was paused
+		if (current->m_accept_waiting && current->m_active_count < current->m_max_clients)
+		{
+			current->m_accept_waiting = 0;
+			uring_accept();
+		}
+		if (current->m_phase != atomic_load(&shutdown_phase))
+			shutdown_step();
+		//every socket stays open for the new server, once the kernel lets go of them
+		if (current->m_phase == SHUTDOWN_HANDOFF)
 		{
-			return i;
+			uring_quiesce();
+			break;
 		}
+		busy = now_ns() - busy;
+		METRIC_ADD(current->m_metrics.m_loop[metric_bucket(busy)], 1);
+		METRIC_ADD(current->m_metrics.m_loop_sum, busy);
 	}
-	return EMPTY_CLIENT; // currently at capacity
 }
-void *client_handler(void * client)
+//a zeroed submission slot; the first request of a chain asks for need
+//slots at once, so a chain never straddles two submissions
+struct io_uring_sqe *uring_sqe(unsigned need)
 {
-	int client_index = *((int *)client); /*convert value passed to int*/
-	//first get the name of the client, store it in m_name
-	if (read(clients[client_index].m_fd, clients[client_index].m_name, BUFFER_SIZE) < 0)
+	struct uring *u = current->m_ring;
+	struct io_uring_sqe *sqe;
+	unsigned tail = atomic_load_explicit(u->m_sq_tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(u->m_sq_head, memory_order_acquire) + need > u->m_entries)
+		uring_enter(0, -1);
+	sqe = &u->m_sqes[tail & *u->m_sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->m_sq_array[tail & *u->m_sq_mask] = tail & *u->m_sq_mask;
+	atomic_store_explicit(u->m_sq_tail, tail + 1, memory_order_release);
+	u->m_ops++;
+	return sqe;
+}
+//submits everything queued, and with wait sleeps until a completion
+//arrives or timeout ns pass (-1 for no limit)
+void uring_enter(int wait, int64_t timeout)
+{
+	struct uring *u = current->m_ring;
+	struct __kernel_timespec ts = { timeout / 1000000000, timeout % 1000000000 };
+	struct io_uring_getevents_arg arg = { 0, 0, 0, timeout < 0 ? 0 : (uintptr_t)&ts };
+	unsigned submit = atomic_load_explicit(u->m_sq_tail, memory_order_relaxed) - atomic_load_explicit(u->m_sq_head, memory_order_acquire);
+	if (submit == 0 && !wait)
+		return;
+	METRIC_ADD(current->m_metrics.m_syscalls, 1);
+	if (syscall(__NR_io_uring_enter, u->m_fd, submit, wait ? 1 : 0, (wait ? IORING_ENTER_GETEVENTS : 0) | IORING_ENTER_EXT_ARG,
+		&arg, sizeof(arg)) == -1 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
 	{
-		perror("Reading Name Error\n");
+		perror("Server Error: io_uring_enter failed");
 		exit(1);
 	}
-	else
+}
+//hands every posted completion to uring_complete(); each slot is copied
+//and released first, handling it may submit (and so post) more
+void uring_reap()
+{
+	struct uring *u = current->m_ring;
+	struct io_uring_cqe cqe;
+	unsigned head = atomic_load_explicit(u->m_cq_head, memory_order_relaxed);
+	while (head != atomic_load_explicit(u->m_cq_tail, memory_order_acquire))
 	{
-		//print to server terminal that a new client has entered
-		printf(">> %s has joined the server\n", clients[client_index].m_name);
-		//welcome the client to the server
-		write(clients[client_index].m_fd, ">>Welcome to the Server!\n", BUFFER_SIZE);
-		//tell all other clients that a new user has entered the server
-		client_has_entered(&clients[client_index]);
+		cqe = u->m_cqes[head & *u->m_cq_mask];
+		atomic_store_explicit(u->m_cq_head, ++head, memory_order_release);
+		uring_complete(&cqe);
+	}
+}
+//handles the writev completions already posted, ahead of the ones before
+//them; the slots are marked so uring_reap() passes over them later
+void uring_reap_sends()
+{
+	struct uring *u = current->m_ring;
+	struct io_uring_cqe *cqe, copy;
+	unsigned head;
+	for (head = atomic_load_explicit(u->m_cq_head, memory_order_relaxed);
+		head != atomic_load_explicit(u->m_cq_tail, memory_order_acquire); head++)
+	{
+		cqe = &u->m_cqes[head & *u->m_cq_mask];
+		if (cqe->user_data >> 56 != URING_SEND)
+			continue;
+		copy = *cqe;
+		cqe->user_data = 0;
+		uring_complete(&copy);
 	}
-	while (exit_flag != 1 && clients[client_index].m_fd != EMPTY_CLIENT) //while client is active
+}
+void uring_complete(struct io_uring_cqe * cqe)
+{
+	int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	uint64_t ticks;
+	//already taken by uring_reap_sends()
+	if (cqe->user_data == 0)
+		return;
+	//a multishot request goes on until a completion without F_MORE
+	if (!more)
+		current->m_ring->m_ops--;
+	switch (cqe->user_data >> 56)
 	{
-		if (read(clients[client_index].m_fd, clients[client_index].m_buffer, BUFFER_SIZE) < 0)
+	case URING_ACCEPT:
+		if (!more)
+			current->m_ring->m_accepting = 0;
+		if (cqe->res >= 0)
+			uring_accepted(cqe->res);
+		else if (cqe->res != -ECANCELED && cqe->res != -EINTR && cqe->res != -ECONNABORTED)
 		{
-			perror("Reading Data Error\n");
+			fprintf(stderr, "Server Error: Accepting issue: %s\n", strerror(-cqe->res));
 			exit(1);
 		}
-		else
+		if (!current->m_accept_waiting)
+			uring_accept();
+		break;
+	case URING_RECV:
+		uring_received(cqe);
+		break;
+	case URING_SEND:
+		uring_sent(cqe);
+		break;
+	case URING_WAKE:
+		//another reactor posted to our mailbox
+		if (cqe->res > 0)
 		{
-			//Check to see if the client is ready to exit
-			if ((strcmp(clients[client_index].m_buffer, "/quit") == 0) || (strcmp(clients[client_index].m_buffer, "/exit") == 0) || (strcmp(clients[client_index].m_buffer, "/part") == 0))
-			{
-				//send the client the exit directive, let client leave on their own
-				write(clients[client_index].m_fd, "/__quit", BUFFER_SIZE);
-				//tell all other clients that the user is leaving the server
-				client_is_leaving(&clients[client_index]);
-				//free up that client's spot in the clients[] array
-				clients[client_index].m_fd = EMPTY_CLIENT;
-			}
-			else
-			{
-				pthread_mutex_lock(&send_mutex);
-				//send user's message to all other clients
-				send_to_clients(&clients[client_index]);
-				pthread_mutex_unlock(&send_mutex);
-			}
+			read(current->m_mailbox.m_wake_fd, &ticks, sizeof(ticks));
+			METRIC_ADD(current->m_metrics.m_syscalls, 1);
+			drain_mailbox();
+		}
+		if (!more)
+			uring_poll(current->m_mailbox.m_wake_fd, URING_WAKE);
+		break;
+	case URING_FLUSH:
+		//the oldest pending frame has waited config.flush_window
+		if (cqe->res > 0)
+		{
+			read(current->m_flush_fd, &ticks, sizeof(ticks));
+			METRIC_ADD(current->m_metrics.m_syscalls, 1);
+			flush_pending();
 		}
+		if (!more)
+			uring_poll(current->m_flush_fd, URING_FLUSH);
+		break;
 	}
-	//this code will be executed once the user has indicated that they are leaving
-	//print to the server terminal that the client is leaving
-	printf(">>%s has exit\n", clients[client_index].m_name);
-	//close that socket used for that client
-	close(clients[client_index].m_fd);
-	//end thread's execution
-	if (pthread_cancel(clients[client_index].m_thread) != 0)
+}
+//a multishot POLLIN on one of the reactor's own descriptors
+void uring_poll(int fd, int op)
+{
+	struct io_uring_sqe *sqe;
+	if (current->m_phase == SHUTDOWN_HANDOFF)
+		return;
+	sqe = uring_sqe(1);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_DATA(op, 0);
+}
+//asks the kernel to cancel the request tagged data
+void uring_cancel(uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_sqe(1);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = URING_DATA(URING_CANCEL, 0);
+}
+//the handoff: cancels every request and handles what still completes
+//until the kernel holds nothing of ours; bytes a recv had already taken
+//are handled as usual, the rest stays in the sockets for the new server
+void uring_quiesce()
+{
+	struct io_uring_sqe *sqe = uring_sqe(1);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+	sqe->user_data = URING_DATA(URING_CANCEL, 0);
+	while (current->m_ring->m_ops > 0)
 	{
-		perror("Ending thread issue");
-		exit(1);
+		uring_enter(1, -1);
+		uring_reap();
 	}
 }
-//this function will send the contents of the sender's buffer
-//to all other users
-void send_to_clients(session * sender)
+//arms the listener's multishot accept, one completion per connection
+void uring_accept()
 {
-	int i;
-	if (exit_flag != 1) // prevents some bogus output
-	{
-		char write_buffer[BUFFER_SIZE];
-		//first format the message, name> message
-		strncpy(write_buffer, sender->m_name, BUFFER_SIZE);
-		strncat(write_buffer, "> ", 2);
-		strncat(write_buffer, sender->m_buffer, BUFFER_SIZE);
-		strncat(write_buffer, "\n", 1);
-		//print to server terminal
-		printf("%s\n", write_buffer);
-		//send message to all active clients except the sender
-		for (i = 0; i < MAX_CLIENT; i++)
-		{
-			if ((clients[i].m_fd != EMPTY_CLIENT) && (i != sender->m_index))
-			{
-				write(clients[i].m_fd, write_buffer, BUFFER_SIZE);
-			}
-		}
-	}
+	struct io_uring_sqe *sqe;
+	if (current->m_listen_fd == -1 || current->m_ring->m_accepting || current->m_phase == SHUTDOWN_HANDOFF)
+		return;
+	sqe = uring_sqe(1);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = current->m_listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = URING_DATA(URING_ACCEPT, 0);
+	current->m_ring->m_accepting = 1;
 }
-//Cntrl-C
-//tells all active clients that the server is shutting down
-//closes all connections, and ends the server
-void signalhandler(int sig)
-{
-	int i = 0;
-	char msg[BUFFER_SIZE];
-	time_t start_time, cur_time;//used to wait for 10 seconds
-	strncpy(msg, ">>The Server will shut down in 10 seconds.\n", BUFFER_SIZE);
-	printf("\n%s\n", msg);
-	fflush(stdout); //ensures that message is printed to server terminal
-	//tell all active clients that server is shutting down
-	for (i = 0; i < MAX_CLIENT; i++)
+//a connection the multishot accept took; it can not be left in the backlog,
+//so when the reactor is full it is closed and accepting pauses until the
+//event loop sees a spot open up
+void uring_accepted(int fd)
+{
+	if (current->m_listen_fd == -1)
 	{
-		if (clients[i].m_fd != EMPTY_CLIENT)
-		{
-			write(clients[i].m_fd, msg, BUFFER_SIZE);
-		}
+		close(fd); //accepted just before the shutdown cancelled accepting
+		return;
 	}
-	//wait 10 seconds, allows user to exit manually if desired
-	time(&start_time);
-	do
+	if (current->m_active_count >= current->m_max_clients)
 	{
-		time(&cur_time);
-	} while ((cur_time - start_time) < 10);
-	strncpy(msg, "/__quit", BUFFER_SIZE);//the exit direcitve
-	//send all active clients the exit directive
-	for (i = 0; i < MAX_CLIENT; i++)
-	{
-		if (clients[i].m_fd != EMPTY_CLIENT)
+		close(fd);
+		if (!current->m_accept_waiting)
 		{
-			write(clients[i].m_fd, msg, BUFFER_SIZE);
+			current->m_accept_waiting = 1;
+			uring_cancel(URING_DATA(URING_ACCEPT, 0));
 		}
+		return;
 	}
-	//close connecton and threads to all active clients
-	for (i = 0; i < MAX_CLIENT; i++)
+	METRIC_ADD(current->m_metrics.m_accepts, 1);
+	client_open(fd);
+}
+//arms the client's multishot recv, the kernel picks a buffer from the
+//reactor's ring for every completion
+void uring_recv(session * client)
+{
+	struct io_uring_sqe *sqe = uring_sqe(1);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->m_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = URING_DATA(URING_RECV, session_handle_of(client));
+}
+//a recv completion: bytes in one of the ring's buffers, the end of the
+//stream or an error; the buffer goes straight back to the ring
+void uring_received(struct io_uring_cqe * cqe)
+{
+	session *client = uring_client(cqe->user_data);
+	unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	if (client != NULL)
 	{
-		if (clients[i].m_fd != EMPTY_CLIENT)
+		if (cqe->res > 0)
+			client_received(client, current->m_ring->m_buf_mem + (size_t)bid * URING_BUF_SIZE, cqe->res);
+		else if (cqe->res == 0)
+			drop_client(client); //client went away without saying goodbye
+		else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
 		{
-			close(clients[i].m_fd);
-			clients[i].m_fd = EMPTY_CLIENT;
-			if (pthread_cancel(clients[i].m_thread) != 0)
-			{
-				perror("Issue ending thread");
-				exit(1);
-			}
+			log_write(LOG_WARN, "Reading Data Error: %s", strerror(-cqe->res));
+			drop_client(client);
 		}
+		//the ring ran dry, or the kernel ended the recv for its own reasons
+		if (client->m_fd != EMPTY_CLIENT && client->m_state != STATE_CLOSING && !(cqe->flags & IORING_CQE_F_MORE)
+			&& current->m_phase != SHUTDOWN_HANDOFF)
+			uring_recv(client);
 	}
-	exit_flag = 1;
-	close(sd);
-	unlink(server_addr.sin_addr);
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+		uring_buffer_return(bid);
 }
-//This function tells all active clients that a client has exit
-void client_is_leaving(session * client_leaving)
+void uring_buffer_return(unsigned bid)
 {
-	int i;
-	char write_buffer[BUFFER_SIZE];
-	//store it in the write_buffer
-	strncpy(write_buffer, ">>", BUFFER_SIZE);
-	strncat(write_buffer, client_leaving->m_name, BUFFER_SIZE);
-	strncat(write_buffer, " has left the ChatRoom.\n", BUFFER_SIZE);
-	//tell all active clients that aren't the one currently leaving
-	for (i = 0; i < MAX_CLIENT; i++)
+	struct uring *u = current->m_ring;
+	struct io_uring_buf *b = &u->m_bufs->bufs[u->m_buf_tail & (URING_BUFFERS - 1)];
+	b->addr = (uintptr_t)(u->m_buf_mem + (size_t)bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	u->m_buf_tail++;
+	atomic_store_explicit((_Atomic uint16_t *)&u->m_bufs->tail, u->m_buf_tail, memory_order_release);
+}
+//session_lookup() for a recv's user_data, which kept 24 bits of the generation
+session *uring_client(uint64_t data)
+{
+	size_t index = (uint32_t)data;
+	session *client;
+	if (index >= current->m_slot_count)
+		return NULL;
+	client = session_at(index);
+	if ((client->m_gen & 0xffffff) != ((data >> 32) & 0xffffff) || client->m_fd == EMPTY_CLIENT)
+		return NULL;
+	return client;
+}
+//-i uring: hands the head of the queue to the kernel as a chain of linked
+//writev()s, FLUSH_IOV frames each; a short write ends the chain early, and
+//the client is flushed again once every writev in it has completed
+void uring_flush(session * client)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_send *req;
+	message *msg;
+	size_t at = 0, i;
+	int chain;
+	if (client->m_dying || client->m_sends > 0)
+		return;
+	if (client->m_q_count == 0)
+	{
+		//the exit directive is out, the client can go
+		if (client->m_state == STATE_CLOSING)
+			close_client(client);
+		return;
+	}
+	//the new server sends what is still queued
+	if (current->m_phase == SHUTDOWN_HANDOFF)
+		return;
+	chain = (client->m_q_count + FLUSH_IOV - 1) / FLUSH_IOV;
+	if (chain > URING_CHAIN)
+		chain = URING_CHAIN;
+	while (client->m_sends < chain)
 	{
-		if ((clients[i].m_fd != 1) && (i != client_leaving->m_index))
+		req = pool_alloc(sizeof(struct uring_send));
+		req->m_client = session_handle_of(client);
+		req->m_count = client->m_q_count - at < FLUSH_IOV ? client->m_q_count - at : FLUSH_IOV;
+		req->m_iov_count = 0;
+		for (i = 0; i < req->m_count; i++)
 		{
-			write(clients[i].m_fd, write_buffer, BUFFER_SIZE);
+			msg = client->m_queue[(client->m_q_head + at + i) % client->m_q_cap];
+			atomic_fetch_add_explicit(&msg->m_refs, 1, memory_order_relaxed);
+			req->m_msgs[i] = msg;
+			//replayed history is written from its mapped log segment, and
+			//what an earlier short write already sent is skipped
+			req->m_iov_count += message_iov(msg, req->m_iov + req->m_iov_count, at + i == 0 ? client->m_q_sent : 0);
 		}
+		sqe = uring_sqe(client->m_sends == 0 ? chain : 1);
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = client->m_fd;
+		sqe->addr = (uintptr_t)req->m_iov;
+		sqe->len = req->m_iov_count;
+		//the next writev starts only once this one wrote everything
+		if (client->m_sends + 1 < chain)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = URING_DATA(URING_SEND, (uintptr_t)req);
+		at += req->m_count;
+		client->m_sends++;
+		client->m_q_busy += req->m_count;
+		METRIC_ADD(current->m_metrics.m_writes, 1);
 	}
+	client->m_blocked = 1;
 }
-//This function tells all active clients that another client has entered the server
-void client_has_entered(session * client_joining)
+//a writev completed: what it wrote leaves the queue, and once the whole
+//chain is back the client is flushed again (or closed, if it was leaving)
+void uring_sent(struct io_uring_cqe * cqe)
+{
+	struct uring_send *req = (struct uring_send *)(uintptr_t)(cqe->user_data & 0x00ffffffffffffffull);
+	session *client = session_lookup(req->m_client);
+	size_t i;
+	if (client != NULL)
+	{
+		client->m_sends--;
+		client->m_q_busy -= req->m_count;
+		if (cqe->res > 0)
+		{
+			METRIC_ADD(current->m_metrics.m_bytes_out, cqe->res);
+			pop_sent(client, cqe->res);
+		}
+		//-ECANCELED: an earlier writev of the chain came up short
+		else if (cqe->res != -ECANCELED && cqe->res != -EINTR && cqe->res != -EAGAIN)
+			schedule_drop(client); //broken connection, drop the client once this pass is over
+		if (client->m_sends == 0)
+		{
+			client->m_blocked = 0;
+			flush_client(client);
+		}
+	}
+	for (i = 0; i < req->m_count; i++)
+		message_release(req->m_msgs[i]);
+	pool_free(req);
+}
+//reads the command line into config
+// -r reactors event loop threads (default: one per online core)
+// -c clients most concurrent sessions
+// -b backlog listen() backlog
+// -q depth  outbound queue slots per client
+// -s policy what to do when a queue is full: drop, coalesce or disconnect
+// -l level  least important log records kept: error, warn, info or debug
+// -f format log output: line (text) or binary (struct log_header records)
+// -H dir    keep a message log per room under dir
+// -N lines  how many earlier lines someone joining a room is sent
+// -K frames how many recent frames each room keeps in memory for that
+// -g secs   how long after the shutdown notice the exit directive goes out
+// -d ms     how long the last frames may take to drain before clients are cut off
+// -U path   Unix socket to hand the listeners and clients over to a new server
+// -M port   serve metrics on 127.0.0.1:port
+// -p port   where clients connect (default SERVER_PORT)
+// -L port   where other nodes of a cluster link to us
+// -J host:port link to that node, may be given more than once
+// -w us     how long queued frames may wait for more before they are written
+// -i io     how the reactors do socket I/O: epoll (default) or uring (io_uring)
+void parse_options(int argc, char * argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "r:c:b:q:s:l:f:H:N:K:g:d:U:M:p:L:J:w:i:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'r':
+			config.reactors = atoi(optarg);
+			break;
+		case 'c':
+			config.max_clients = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			config.backlog = atoi(optarg);
+			break;
+		case 'q':
+			config.queue_depth = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			if (strcmp(optarg, "drop") == 0)
+				config.slow_policy = POLICY_DROP_OLDEST;
+			else if (strcmp(optarg, "coalesce") == 0)
+				config.slow_policy = POLICY_COALESCE;
+			else if (strcmp(optarg, "disconnect") == 0)
+				config.slow_policy = POLICY_DISCONNECT;
+			else
+				usage(argv[0]);
+			break;
+		case 'l':
+			if (strcmp(optarg, "error") == 0)
+				config.log_level = LOG_ERROR;
+			else if (strcmp(optarg, "warn") == 0)
+				config.log_level = LOG_WARN;
+			else if (strcmp(optarg, "info") == 0)
+				config.log_level = LOG_INFO;
+			else if (strcmp(optarg, "debug") == 0)
+				config.log_level = LOG_DEBUG;
+			else
+				usage(argv[0]);
+			break;
+		case 'f':
+			if (strcmp(optarg, "line") == 0)
+				config.log_format = LOG_LINE;
+			else if (strcmp(optarg, "binary") == 0)
+				config.log_format = LOG_BINARY;
+			else
+				usage(argv[0]);
+			break;
+		case 'H':
+			config.history_dir = optarg;
+			break;
+		case 'N':
+			config.history_replay = strtoul(optarg, NULL, 10);
+			break;
+		case 'K':
+			config.scrollback = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			config.shutdown_grace = atoi(optarg);
+			break;
+		case 'd':
+			config.shutdown_drain = atoi(optarg);
+			break;
+		case 'U':
+			config.handoff_path = optarg;
+			break;
+		case 'M':
+			config.metrics_port = atoi(optarg);
+			break;
+		case 'p':
+			config.port = atoi(optarg);
+			break;
+		case 'L':
+			config.link_port = atoi(optarg);
+			break;
+		case 'J':
+			if (config.link_dials == LINK_MAX_PEERS || strrchr(optarg, ':') == NULL)
+				usage(argv[0]);
+			config.link_to[config.link_dials++] = optarg;
+			break;
+		case 'w':
+			config.flush_window = atol(optarg);
+			break;
+		case 'i':
+			if (strcmp(optarg, "epoll") == 0)
+				config.backend = BACKEND_EPOLL;
+			else if (strcmp(optarg, "uring") == 0)
+				config.backend = BACKEND_URING;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (config.reactors == 0)
+		config.reactors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (config.reactors > MAX_REACTORS)
+		config.reactors = MAX_REACTORS;
+	//a half-written frame always holds one slot, so at least two are needed
+	if (config.reactors < 1 || config.queue_depth < 2 || config.max_clients < 1 || config.max_clients > INT32_MAX || config.backlog < 1)
+		usage(argv[0]);
+	if (config.shutdown_grace < 0 || config.shutdown_drain < 0 || config.metrics_port < 0 || config.metrics_port > 65535)
+		usage(argv[0]);
+	if (config.port < 1 || config.port > 65535 || config.link_port < 0 || config.link_port > 65535)
+		usage(argv[0]);
+	if (config.flush_window < 0 || config.flush_window > FLUSH_WINDOW_MAX)
+		usage(argv[0]);
+	if (config.handoff_path != NULL && strlen(config.handoff_path) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+		usage(argv[0]);
+	//room names are escaped into the path, leave them room
+	if (config.history_dir != NULL && strlen(config.history_dir) > HISTORY_PATH / 2)
+		usage(argv[0]);
+}
+void usage(const char * prog)
+{
+	printf("Usage: %s [-r reactors] [-c clients] [-b backlog] [-q depth(>=2)] [-s drop|coalesce|disconnect]\n"
+		"       [-l error|warn|info|debug] [-f line|binary] [-H history dir] [-N replayed lines]\n"
+		"       [-K scrollback frames] [-g grace seconds] [-d drain ms] [-U handoff socket]\n"
+		"       [-M metrics port] [-p port] [-L link port] [-J host:port]... [-w flush window us]\n"
+		"       [-i epoll|uring]\n", prog);
+	exit(1);
+}
+//slot index -> session, slots never move once their chunk exists
+session *session_at(size_t index)
+{
+	return &current->m_chunks[index / SLAB_CHUNK][index % SLAB_CHUNK];
+}
+session_handle session_handle_of(session * client)
 {
+	return ((session_handle)client->m_gen << 32) | (uint32_t)client->m_index;
+}
+//resolves a handle, NULL if the slot was released since the handle was made
+session *session_lookup(session_handle handle)
+{
+	size_t index = (uint32_t)handle;
+	session *client;
+	if (index >= current->m_slot_count)
+		return NULL;
+	client = session_at(index);
+	if (client->m_gen != (uint32_t)(handle >> 32) || client->m_fd == EMPTY_CLIENT)
+		return NULL;
+	return client;
+}
+//pops a slot off the free list, growing the slab when it runs dry
+//NULL when the reactor already holds its share of config.max_clients
+session *session_alloc()
+{
+	session *client;
+	if (current->m_active_count >= current->m_max_clients)
+		return NULL;
+	if (current->m_free_head == EMPTY_CLIENT && grow_sessions() == -1)
+		return NULL;
+	client = session_at(current->m_free_head);
+	current->m_free_head = client->m_next_free;
+	current->m_active_count++;
+	METRIC_ADD(current->m_metrics.m_opened, 1);
+	return client;
+}
+//puts a slot back on the free list, the new generation voids old handles
+void session_free(session * client)
+{
+	client->m_gen++;
+	client->m_next_free = current->m_free_head;
+	current->m_free_head = client->m_index;
+	current->m_active_count--;
+	METRIC_ADD(current->m_metrics.m_closed, 1);
+}
+//adds one chunk of SLAB_CHUNK unused sessions to the free list
+//buffers are only allocated once a slot is actually used
+int grow_sessions()
+{
+	session **chunks, *chunk;
 	int i;
-	char write_buffer[BUFFER_SIZE];
-	//store it in the write_buffer
-	strncpy(write_buffer, ">>", BUFFER_SIZE);
-	strncat(write_buffer, client_joining->m_name, BUFFER_SIZE);
-	strncat(write_buffer, " has entered the ChatRoom.\n", BUFFER_SIZE);
-	//tell all active clients that aren't the one currently entering
-	for (i = 0; i < MAX_CLIENT; i++)
+	if ((chunks = realloc(current->m_chunks, (current->m_chunk_count + 1) * sizeof(session *))) == NULL)
+		return -1;
+	current->m_chunks = chunks;
+	if ((chunk = calloc(SLAB_CHUNK, sizeof(session))) == NULL)
+		return -1;
+	current->m_chunks[current->m_chunk_count++] = chunk;
+	//link the new slots in order, lowest index first
+	for (i = SLAB_CHUNK - 1; i >= 0; i--)
+	{
+		chunk[i].m_index = current->m_slot_count + i;
+		chunk[i].m_fd = EMPTY_CLIENT;
+		chunk[i].m_next_free = current->m_free_head;
+		current->m_free_head = current->m_slot_count + i;
+	}
+	current->m_slot_count += SLAB_CHUNK;
+	return 0;
+}
+//puts a socket into non-blocking mode, -1 on failure
+int set_nonblocking(int fd)
+{
+	int flags;
+	if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+//accepts every pending connection there is room for
+//when the server is full the rest wait in the listen backlog,
+//the event loop calls back in here once a spot opens up
+void accept_clients()
+{
+	struct sockaddr_in client_addr;
+	socklen_t length;
+	int fd;
+	current->m_accept_waiting = 0;
+	//the listener is closed once the shutdown begins
+	while (current->m_listen_fd != -1)
+	{
+		if (current->m_active_count >= current->m_max_clients)
+		{
+			current->m_accept_waiting = 1;
+			return;
+		}
+		length = sizeof(client_addr);
+		METRIC_ADD(current->m_metrics.m_syscalls, 3); //accept() and the two fcntl()s
+		if ((fd = accept(current->m_listen_fd, (struct sockaddr*)&client_addr, &length)) == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return; //backlog drained
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("Server Error: Accepting issue");
+			exit(1);
+		}
+		if (set_nonblocking(fd) == -1)
+		{
+			log_write(LOG_ERROR, "Server Error: Non-blocking client socket failed: %s", strerror(errno));
+			close(fd);
+			continue;
+		}
+		METRIC_ADD(current->m_metrics.m_accepts, 1);
+		client_open(fd);
+	}
+}
+//gives a connected socket a session and adds it to the reactor's epoll set
+//(or arms its recv, with io_uring)
+//NULL, with the socket closed, if either failed
+session *client_open(int fd)
+{
+	struct epoll_event ev;
+	session *client;
+	int on = 1;
+	if ((client = session_alloc()) == NULL)
+	{
+		log_write(LOG_ERROR, "Server Error: Out of memory");
+		close(fd);
+		return NULL;
+	}
+	client->m_fd = fd;
+	client->m_state = STATE_NAME;
+	client->m_name = client->m_name_inline;
+	client->m_name[0] = '\0';
+	client->m_blocked = 0;
+	client->m_pending = 0;
+	client->m_dying = 0;
+	client->m_sends = 0;
+	client->m_q_busy = 0;
+	client->m_stream = NULL;
+	client->m_owed = client->m_credited = 0;
+	client->m_room = NULL;
+	//frames are batched before they reach the socket, Nagle would only add
+	//a round trip on top
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	METRIC_ADD(current->m_metrics.m_syscalls, 1);
+	//a reused slot keeps the outbound ring of its last occupant
+	if (client->m_queue == NULL)
+	{
+		client->m_q_cap = config.queue_depth < QUEUE_INITIAL ? config.queue_depth : QUEUE_INITIAL;
+		client->m_queue = pool_alloc(client->m_q_cap * sizeof(message *));
+		current->m_session_bytes += client->m_q_cap * sizeof(message *);
+	}
+	if (current->m_ring != NULL)
+	{
+		uring_recv(client);
+		return client;
+	}
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.u64 = session_handle_of(client);
+	if (epoll_ctl(current->m_epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		log_write(LOG_ERROR, "Server Error: epoll_ctl failed: %s", strerror(errno));
+		close(fd);
+		client->m_fd = EMPTY_CLIENT;
+		session_free(client);
+		return NULL;
+	}
+	return client;
+}
+//edge-triggered: keep reading until the socket reports EAGAIN
+//the bytes are reassembled into frames, each complete frame is one message
+void on_client_readable(session * client)
+{
+	struct frame_reader *in;
+	unsigned char *space;
+	size_t room;
+	ssize_t n;
+	while (client->m_fd != EMPTY_CLIENT && client->m_state != STATE_CLOSING)
+	{
+		in = rx_reader(client);
+		space = frame_reader_space(in, &room);
+		n = read(client->m_fd, space, room);
+		METRIC_ADD(current->m_metrics.m_syscalls, 1);
+		if (n > 0)
+		{
+			frame_reader_commit(in, n);
+			METRIC_ADD(current->m_metrics.m_bytes_in, n);
+			TRACE_STAMP(current->m_t_read);
+			if (client_frames(client, in) == -1)
+				return;
+		}
+		else if (n == 0)
+		{
+			//client went away without saying goodbye
+			drop_client(client);
+		}
+		else if (errno == EINTR)
+			continue;
+		else
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				log_write(LOG_WARN, "Reading Data Error: %s", strerror(errno));
+				drop_client(client);
+			}
+			return;
+		}
+	}
+}
+//-i uring: bytes a recv brought, put through the same reassembly as a read()
+void client_received(session * client, const unsigned char * data, size_t len)
+{
+	struct frame_reader *in;
+	unsigned char *space;
+	size_t room, n;
+	METRIC_ADD(current->m_metrics.m_bytes_in, len);
+	TRACE_STAMP(current->m_t_read);
+	while (len > 0 && client->m_fd != EMPTY_CLIENT && client->m_state != STATE_CLOSING)
+	{
+		in = rx_reader(client);
+		space = frame_reader_space(in, &room);
+		n = len < room ? len : room;
+		memcpy(space, data, n);
+		frame_reader_commit(in, n);
+		data += n;
+		len -= n;
+		if (client_frames(client, in) == -1)
+			return;
+	}
+}
+//handles every complete frame in in, a trailing partial one stays with the
+//client; -1 if the client was dropped or is closing, nothing more is read
+int client_frames(session * client, struct frame_reader * in)
+{
+	rx_block *block = in == &client->m_in ? rx_of(in->m_buf) : current->m_rx;
+	struct frame f;
+	int got;
+	//one read() may carry several frames, or only part of one
+	while (client->m_fd != EMPTY_CLIENT && client->m_state != STATE_CLOSING
+		&& (got = frame_next(in, &f)) != 0)
+	{
+		if (got == -1 || ((f.type == FRAME_CHUNK || f.type == FRAME_CHUNK_END) && f.length > STREAM_CHUNK))
+		{
+			log_write(LOG_WARN, "Server Error: Malformed frame, dropping client");
+			frame_reader_reset(&current->m_scratch);
+			drop_client(client);
+			return -1;
+		}
+		//a piece of a streamed message goes on as it is, nul bytes and all
+		if (f.type == FRAME_CHUNK || f.type == FRAME_CHUNK_END)
+		{
+			METRIC_ADD(current->m_metrics.m_msgs_in, 1);
+			stream_piece(client, f.type == FRAME_CHUNK_END, block, (const char *)f.payload, f.length);
+			continue;
+		}
+		//a long line may be broadcast from where it lies, if it is all text
+		current->m_slice_block = NULL;
+		if (f.length >= SLICE_MIN && memchr(f.payload, '\0', f.length) == NULL)
+		{
+			current->m_slice_block = block;
+			current->m_slice = f.payload;
+			current->m_slice_len = f.length;
+		}
+		//copy the payload out as a string, long lines get truncated
+		if (f.length > BUFFER_SIZE - 1)
+			f.length = BUFFER_SIZE - 1;
+		memcpy(current->m_text, f.payload, f.length);
+		current->m_text[f.length] = '\0';
+		METRIC_ADD(current->m_metrics.m_msgs_in, 1);
+		TRACE_RECORD(TRACE_PARSE, current->m_t_read);
+		TRACE_STAMP(current->m_t_parse);
+		on_client_message(client, f.type, current->m_text);
+		current->m_slice_block = NULL;
+	}
+	if (client->m_fd == EMPTY_CLIENT || client->m_state == STATE_CLOSING)
+	{
+		frame_reader_reset(&current->m_scratch);
+		return -1;
+	}
+	keep_partial_frame(client, in);
+	return 0;
+}
+//moves a partial frame left in the scratch buffer into a buffer owned by
+//the client, and gives that buffer back once the frame is complete
+void keep_partial_frame(session * client, struct frame_reader * in)
+{
+	if (in == &client->m_in)
+	{
+		if (in->m_len == 0)
+		{
+			rx_release(rx_of(in->m_buf));
+			in->m_buf = NULL;
+			current->m_session_bytes -= in->m_cap;
+		}
+		return;
+	}
+	if (in->m_len == in->m_start)
+		return;
+	//a whole block, it holds a whole FRAME_MAX_PAYLOAD frame with room to spare
+	client->m_in.m_buf = rx_alloc()->m_data;
+	client->m_in.m_cap = RX_BLOCK_CAP;
+	client->m_in.m_start = 0;
+	client->m_in.m_len = in->m_len - in->m_start;
+	memcpy(client->m_in.m_buf, in->m_buf + in->m_start, client->m_in.m_len);
+	current->m_session_bytes += RX_BLOCK_CAP;
+	frame_reader_reset(in);
+}
+//the reader the next read() lands in: the client's own while it has half a
+//frame pending, the reactor's scratch otherwise; bytes that sliced lines
+//still point at are never read over, the reader moves to fresh space instead
+struct frame_reader *rx_reader(session * client)
+{
+	struct frame_reader *in = &client->m_in;
+	rx_block *b;
+	if (in->m_buf != NULL)
+	{
+		b = rx_of(in->m_buf);
+		if (in->m_start > 0 && atomic_load_explicit(&b->m_refs, memory_order_acquire) > 1)
+		{
+			//compacting would overwrite them, the partial frame moves out instead
+			in->m_buf = rx_alloc()->m_data;
+			memcpy(in->m_buf, b->m_data + in->m_start, in->m_len - in->m_start);
+			in->m_len -= in->m_start;
+			in->m_start = 0;
+			rx_release(b);
+		}
+		return in;
+	}
+	//the scratch is empty between reads, only where it starts changes
+	in = &current->m_scratch;
+	b = current->m_rx;
+	if (atomic_load_explicit(&b->m_refs, memory_order_acquire) == 1)
+		current->m_rx_used = 0;
+	else if (RX_BLOCK_CAP - current->m_rx_used < RX_READ_MIN)
+	{
+		current->m_rx = rx_alloc();
+		current->m_rx_used = 0;
+		rx_release(b);
+	}
+	in->m_buf = current->m_rx->m_data + current->m_rx_used;
+	in->m_cap = RX_BLOCK_CAP - current->m_rx_used;
+	return in;
+}
+//a receive block from the largest pool class, the caller holds the only reference
+rx_block *rx_alloc()
+{
+	rx_block *b = pool_alloc(sizeof(rx_block) + RX_BLOCK_CAP);
+	atomic_init(&b->m_refs, 1);
+	return b;
+}
+//the block a client's m_in buffer is, it always starts at the block's data
+rx_block *rx_of(unsigned char * buf)
+{
+	return (rx_block *)(buf - offsetof(rx_block, m_data));
+}
+//drops one reference, from any reactor
+void rx_release(rx_block * b)
+{
+	if (atomic_fetch_sub_explicit(&b->m_refs, 1, memory_order_acq_rel) == 1)
+		pool_free(b);
+}
+//stores the user name, inline if it is short enough
+void set_name(session * client, const char * name)
+{
+	size_t len = strlen(name);
+	if (len < NAME_INLINE)
+		client->m_name = client->m_name_inline;
+	else
+	{
+		client->m_name = pool_alloc(len + 1);
+		current->m_session_bytes += len + 1;
+	}
+	memcpy(client->m_name, name, len + 1);
+}
+//gives a long name's buffer back, the session is left with an empty name
+void free_name(session * client)
+{
+	if (client->m_name != client->m_name_inline)
+	{
+		current->m_session_bytes -= strlen(client->m_name) + 1;
+		pool_free(client->m_name);
+		client->m_name = client->m_name_inline;
+	}
+	client->m_name[0] = '\0';
+}
+//user names are one word so /msg can tell them from the text, never
+//start with '/' so they can not be mistaken for a command, and hold only
+//printable characters so nobody can fake a line or a name that can not be typed
+int valid_name(const char * name)
+{
+	size_t len = strlen(name), i;
+	if (len == 0 || len >= NICK_SIZE || name[0] == '/')
+		return 0;
+	for (i = 0; i < len; i++)
+	{
+		if (name[i] == ' ' || !isprint((unsigned char)name[i]))
+			return 0;
+	}
+	return 1;
+}
+//takes name for the client in the name index, -1 if someone has it already
+int nick_claim(const char * name, session * client)
+{
+	uint32_t h = room_hash(name);
+	nick *n;
+	pthread_rwlock_wrlock(&nick_lock);
+	if (nick_buckets > 0)
+	{
+		for (n = nick_table[h & (nick_buckets - 1)]; n != NULL; n = n->m_next)
+		{
+			if (n->m_hash == h && strcmp(n->m_name, name) == 0)
+			{
+				pthread_rwlock_unlock(&nick_lock);
+				return -1;
+			}
+		}
+	}
+	//keep the load factor at or below one
+	if (nick_total >= nick_buckets)
+		nick_grow();
+	if ((n = malloc(sizeof(nick))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	strncpy(n->m_name, name, NICK_SIZE - 1);
+	n->m_name[NICK_SIZE - 1] = '\0';
+	n->m_hash = h;
+	n->m_reactor = current->m_id;
+	n->m_handle = session_handle_of(client);
+	n->m_next = nick_table[h & (nick_buckets - 1)];
+	nick_table[h & (nick_buckets - 1)] = n;
+	nick_total++;
+	pthread_rwlock_unlock(&nick_lock);
+	return 0;
+}
+//frees the client's name in the index, if the client is the one holding it
+void nick_release(const char * name, session * client)
+{
+	uint32_t h = room_hash(name);
+	session_handle handle = session_handle_of(client);
+	nick **link, *n;
+	if (name[0] == '\0')
+		return; //never got through the handshake
+	pthread_rwlock_wrlock(&nick_lock);
+	for (link = &nick_table[h & (nick_buckets - 1)]; (n = *link) != NULL; link = &n->m_next)
+	{
+		if (n->m_hash == h && n->m_reactor == current->m_id && n->m_handle == handle && strcmp(n->m_name, name) == 0)
+		{
+			*link = n->m_next;
+			nick_total--;
+			free(n);
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&nick_lock);
+}
+//where the session called name lives, -1 if nobody is
+int nick_find(const char * name, int * reactor_id, session_handle * handle)
+{
+	uint32_t h = room_hash(name);
+	nick *n;
+	int found = -1;
+	pthread_rwlock_rdlock(&nick_lock);
+	if (nick_buckets > 0)
+	{
+		for (n = nick_table[h & (nick_buckets - 1)]; n != NULL; n = n->m_next)
+		{
+			if (n->m_hash == h && strcmp(n->m_name, name) == 0)
+			{
+				*reactor_id = n->m_reactor;
+				*handle = n->m_handle;
+				found = 0;
+				break;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&nick_lock);
+	return found;
+}
+//doubles the bucket array and rehashes every name into it
+//called with nick_lock held for writing
+void nick_grow()
+{
+	size_t buckets = nick_buckets ? nick_buckets * 2 : NICK_BUCKETS;
+	nick **table, *n, *next;
+	size_t i;
+	if ((table = calloc(buckets, sizeof(nick *))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	for (i = 0; i < nick_buckets; i++)
+	{
+		for (n = nick_table[i]; n != NULL; n = next)
+		{
+			next = n->m_next;
+			n->m_next = table[n->m_hash & (buckets - 1)];
+			table[n->m_hash & (buckets - 1)] = n;
+		}
+	}
+	free(nick_table);
+	nick_table = table;
+	nick_buckets = buckets;
+}
+// /nick: takes the new name first, so the old one is only given up on success
+void rename_client(session * client, const char * name)
+{
+	char notice[FRAME_MAX_PAYLOAD];
+	message *msg;
+	if (!valid_name(name))
+	{
+		snprintf(notice, sizeof(notice), ">>Names are 1 to %d printable characters without spaces.\n", NICK_SIZE - 1);
+		queue_to_client(client, FRAME_NOTICE, notice);
+		return;
+	}
+	if (strcmp(name, client->m_name) == 0)
+		return;
+	if (nick_claim(name, client) == -1)
+	{
+		snprintf(notice, sizeof(notice), ">>%s is already taken.\n", name);
+		queue_to_client(client, FRAME_NOTICE, notice);
+		return;
+	}
+	log_write(LOG_INFO, ">>%s is now known as %s", client->m_name, name);
+	msg = message_printf(FRAME_NOTICE, ">>%s is now known as %s.\n", client->m_name, name);
+	nick_release(client->m_name, client);
+	free_name(client);
+	set_name(client, name);
+	//the room hears it, and so does the one who asked
+	broadcast_to_room(client->m_room, NULL, msg);
+	message_release(msg);
+}
+// /msg: one recipient found through the name index, no room involved
+void send_direct(session * sender, const char * name, size_t name_len, const char * text)
+{
+	char to[NICK_SIZE], notice[FRAME_MAX_PAYLOAD];
+	session_handle handle;
+	session *target;
+	message *msg;
+	int r;
+	if (name_len >= NICK_SIZE || (memcpy(to, name, name_len), to[name_len] = '\0', nick_find(to, &r, &handle) == -1))
+	{
+		snprintf(notice, sizeof(notice), ">>No one here is called %.*s.\n", (int)(name_len < NICK_SIZE ? name_len : NICK_SIZE), name);
+		queue_to_client(sender, FRAME_NOTICE, notice);
+		return;
+	}
+	msg = message_printf(FRAME_TEXT, "[private] %s> %s\n", sender->m_name, text);
+	if (r != current->m_id)
+		post_to_reactor(r, MAIL_DIRECT, NULL, handle, msg);
+	else if ((target = session_lookup(handle)) != NULL && target->m_state == STATE_CHAT)
+		enqueue_message(target, msg);
+	message_release(msg);
+}
+//socket has room again, push out whatever is still queued
+void on_client_writable(session * client)
+{
+	flush_client(client);
+}
+//the name handshake / quit / broadcast logic that client_handler used to run
+//text is the frame's payload as a nul-terminated string
+void on_client_message(session * client, int type, const char * text)
+{
+	struct command cmd;
+	char notice[FRAME_MAX_PAYLOAD];
+	int id;
+	if (client->m_state == STATE_NAME)
+	{
+		//a line typed after a refused name is the next try
+		if (type != FRAME_NAME && type != FRAME_TEXT)
+			return; //nothing else makes sense before the handshake
+		id = command_parse(text, &cmd);
+		if (id == CMD_QUIT || id == CMD_EXIT || id == CMD_PART)
+		{
+			//gave up before getting in
+			client->m_state = STATE_CLOSING;
+			queue_to_client(client, FRAME_QUIT, "");
+			return;
+		}
+		if (!valid_name(text))
+		{
+			snprintf(notice, sizeof(notice), ">>Names are 1 to %d printable characters without spaces, please pick another.\n", NICK_SIZE - 1);
+			queue_to_client(client, FRAME_NOTICE, notice);
+			return;
+		}
+		if (nick_claim(text, client) == -1)
+		{
+			snprintf(notice, sizeof(notice), ">>%s is already taken, please pick another name.\n", text);
+			queue_to_client(client, FRAME_NOTICE, notice);
+			return;
+		}
+		//first message from the client is its name, store it in m_name
+		set_name(client, text);
+		client->m_state = STATE_CHAT;
+		//print to server terminal that a new client has entered
+		log_write(LOG_INFO, ">> %s has joined the server", client->m_name);
+		//welcome the client to the server
+		queue_to_client(client, FRAME_NOTICE, ">>Welcome to the Server!\n");
+		//everyone starts out in the lobby
+		change_room(client, DEFAULT_ROOM);
+		return; //the name is not a chat line
+	}
+	else if (type != FRAME_TEXT)
+		return; //unknown frame types are ignored
+	//chat text is told apart from a command by its first byte
+	switch (command_parse(text, &cmd))
+	{
+	case CMD_NONE:
+		//send user's message to all other clients
+		send_to_clients(client, text);
+		break;
+	//Check to see if the client is ready to exit
+	case CMD_QUIT:
+	case CMD_EXIT:
+	case CMD_PART:
+		//tell all other clients that the user is leaving the server
+		client_is_leaving(client);
+		room_leave(client);
+		//send the client the exit directive, let client leave on their own
+		client->m_state = STATE_CLOSING;
+		queue_to_client(client, FRAME_QUIT, "");
+		break;
+	case CMD_JOIN:
+		change_room(client, cmd.name);
+		break;
+	case CMD_LEAVE:
+		change_room(client, DEFAULT_ROOM);
+		break;
+	case CMD_NICK:
+		rename_client(client, cmd.name);
+		break;
+	case CMD_MSG:
+		send_direct(client, cmd.name, cmd.name_len, cmd.text);
+		break;
+	case CMD_HISTORY:
+		//as many lines as asked for, up to what a join gets
+		if (client->m_room->m_scroll == NULL && client->m_room->m_history == NULL)
+			queue_to_client(client, FRAME_NOTICE, ">>This server keeps no history.\n");
+		else
+			room_replay(client, client->m_room, cmd.count > 0 && cmd.count < config.history_replay ? cmd.count : config.history_replay);
+		break;
+	case CMD_BAD_ARGS:
+		snprintf(notice, sizeof(notice), ">>Usage: %s\n", cmd.spec->m_usage);
+		queue_to_client(client, FRAME_NOTICE, notice);
+		break;
+	case CMD_UNKNOWN:
+		snprintf(notice, sizeof(notice), ">>Unknown command %.*s\n", (int)(strcspn(text, " ") < 64 ? strcspn(text, " ") : 64), text);
+		queue_to_client(client, FRAME_NOTICE, notice);
+		break;
+	}
+}
+//releases the client's slot in the session slab
+void close_client(session * client)
+{
+	if (client->m_fd == EMPTY_CLIENT)
+		return;
+	//print to the server terminal that the client is leaving
+	if (client->m_state != STATE_NAME)
+		log_write(LOG_INFO, ">>%s has exit", client->m_name);
+	if (client->m_room != NULL)
+		room_leave(client);
+	//io_uring holds its own reference to the socket: shutdown() is what
+	//ends the recv and any writev in flight, and tells the peer
+	if (current->m_ring != NULL)
+	{
+		shutdown(client->m_fd, SHUT_RDWR);
+		METRIC_ADD(current->m_metrics.m_syscalls, 1);
+	}
+	//closing the socket also removes it from the epoll set
+	close(client->m_fd);
+	client->m_fd = EMPTY_CLIENT;
+	clear_queue(client);
+	//the outbound ring stays with the slot, the rest goes back to the pool
+	nick_release(client->m_name, client);
+	free_name(client);
+	if (client->m_in.m_buf != NULL)
+	{
+		current->m_session_bytes -= client->m_in.m_cap;
+		rx_release(rx_of(client->m_in.m_buf));
+		client->m_in.m_buf = NULL;
+	}
+	session_free(client);
+}
+//closes a client that disappeared, telling the others if it had joined
+void drop_client(session * client)
+{
+	if (client->m_state == STATE_CHAT)
+	{
+		client->m_state = STATE_CLOSING;
+		client_is_leaving(client);
+	}
+	close_client(client);
+}
+//marks a client to be dropped by reap_clients(), used wherever a client
+//breaks in the middle of serving someone else
+void schedule_drop(session * client)
+{
+	session_handle *grown;
+	if (client->m_dying)
+		return;
+	if (current->m_reap_count == current->m_reap_cap)
+	{
+		current->m_reap_cap = current->m_reap_cap ? current->m_reap_cap * 2 : 64;
+		if ((grown = realloc(current->m_reap_list, current->m_reap_cap * sizeof(session_handle))) == NULL)
+		{
+			perror("Server Error: Out of memory");
+			exit(1);
+		}
+		current->m_reap_list = grown;
+	}
+	client->m_dying = 1;
+	current->m_reap_list[current->m_reap_count++] = session_handle_of(client);
+}
+//remembers that the client has frames to write, they go out with everyone
+//else's at the end of the loop pass (or of the -w window)
+void flush_later(session * client)
+{
+	session_handle *grown;
+	struct itimerspec window = { { 0, 0 }, { config.flush_window / 1000000, config.flush_window % 1000000 * 1000 } };
+	if (client->m_pending)
+		return;
+	if (current->m_flush_count == current->m_flush_cap)
+	{
+		current->m_flush_cap = current->m_flush_cap ? current->m_flush_cap * 2 : 64;
+		if ((grown = realloc(current->m_flush_list, current->m_flush_cap * sizeof(session_handle))) == NULL)
+		{
+			perror("Server Error: Out of memory");
+			exit(1);
+		}
+		current->m_flush_list = grown;
+	}
+	//the window starts with the first frame, later ones do not extend it
+	if (current->m_flush_count == 0 && current->m_flush_fd != -1)
+		timerfd_settime(current->m_flush_fd, 0, &window, NULL);
+	client->m_pending = 1;
+	current->m_flush_list[current->m_flush_count++] = session_handle_of(client);
+}
+//writes out every client on the flush list, one writev() each as long as
+//the socket takes it; a flush that closes a client may add to the list
+void flush_pending()
+{
+	session *client;
+	size_t i;
+	for (i = 0; i < current->m_flush_count; i++)
+	{
+		if ((client = session_lookup(current->m_flush_list[i])) == NULL)
+			continue;
+		client->m_pending = 0;
+		if (!client->m_blocked)
+			flush_client(client);
+	}
+	current->m_flush_count = 0;
+	reap_clients();
+}
+//drops every scheduled client, the leave notices may schedule more
+void reap_clients()
+{
+	session *client;
+	while (current->m_reap_count > 0)
+	{
+		if ((client = session_lookup(current->m_reap_list[--current->m_reap_count])) != NULL)
+			drop_client(client);
+	}
+}
+//allocates a message with room for len frame bytes, the caller holds
+//the only reference and fills in m_data
+message *message_alloc(size_t len)
+{
+	message *msg = pool_alloc(sizeof(message) + len);
+	atomic_init(&msg->m_refs, 1);
+	msg->m_len = len;
+	msg->m_segment = NULL;
+	msg->m_block = NULL;
+	msg->m_stream = NULL;
+	msg->m_head = msg->m_tail = 0;
+#ifdef CHAT_TRACE
+	msg->m_t_read = msg->m_t_parse = msg->m_t_room = 0;
+#endif
+	return msg;
+}
+//encodes text as one frame, the caller holds the only reference
+message *message_create(int type, const char * text)
+{
+	size_t len = strlen(text);
+	message *msg = message_alloc(FRAME_HEADER_MAX + len);
+	msg->m_len = frame_encode(msg->m_data, FRAME_HEADER_MAX + len, type, text, len);
+	return msg;
+}
+//formats the payload straight into the message, no staging buffer
+//payloads longer than FRAME_MAX_PAYLOAD are cut short
+message *message_printf(int type, const char * format, ...)
+{
+	va_list args;
+	message *msg;
+	size_t len, h;
+	int n;
+	va_start(args, format);
+	n = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	len = n < 0 ? 0 : (n > FRAME_MAX_PAYLOAD ? FRAME_MAX_PAYLOAD : (size_t)n);
+	//one more byte for the nul vsnprintf() always writes
+	msg = message_alloc(FRAME_HEADER_MAX + len + 1);
+	h = frame_put_header(msg->m_data, type, len);
+	va_start(args, format);
+	vsnprintf((char *)msg->m_data + h, len + 1, format, args);
+	va_end(args);
+	msg->m_len = h + len;
+	return msg;
+}
+//frames head, len bytes of text and tail as one payload without copying the
+//text: it stays in block b where it was read, m_data only gets the bytes
+//around it (b may be NULL when len is 0)
+message *message_slice(int type, const void * head, size_t head_len, rx_block * b, const char * text, size_t len,
+	const char * tail)
+{
+	size_t tail_len = strlen(tail), h;
+	message *msg;
+	//cut short, but keep the tail
+	if (head_len + len + tail_len > SLICE_MAX)
+		len = SLICE_MAX - head_len - tail_len;
+	msg = message_alloc(FRAME_HEADER_MAX + head_len + tail_len);
+	h = frame_put_header(msg->m_data, type, head_len + len + tail_len);
+	memcpy(msg->m_data + h, head, head_len);
+	memcpy(msg->m_data + h + head_len, tail, tail_len);
+	msg->m_len = h + head_len + len + tail_len;
+	if (b == NULL)
+		return msg;
+	msg->m_head = h + head_len;
+	msg->m_tail = tail_len;
+	msg->m_block = b;
+	msg->m_offset = (const unsigned char *)text - b->m_data;
+	atomic_fetch_add_explicit(&b->m_refs, 1, memory_order_relaxed);
+	//the scratch must not read over it while the message lives
+	if (b == current->m_rx && (size_t)msg->m_offset + len > current->m_rx_used)
+		current->m_rx_used = msg->m_offset + len;
+	return msg;
+}
+//the pieces of a message's frame for a writev(), less its first skip bytes
+//returns the number of iovecs filled in, at most three
+int message_iov(message * msg, struct iovec * iov, size_t skip)
+{
+	struct iovec all[3];
+	int parts = 1, i, n = 0;
+	all[0].iov_base = message_bytes(msg);
+	all[0].iov_len = msg->m_len;
+	if (msg->m_block != NULL)
+	{
+		all[0].iov_len = msg->m_head;
+		all[1].iov_base = msg->m_block->m_data + msg->m_offset;
+		all[1].iov_len = msg->m_len - msg->m_head - msg->m_tail;
+		all[2].iov_base = msg->m_data + msg->m_head;
+		all[2].iov_len = msg->m_tail;
+		parts = 3;
+	}
+	for (i = 0; i < parts; i++)
+	{
+		if (skip >= all[i].iov_len)
+		{
+			skip -= all[i].iov_len;
+			continue;
+		}
+		iov[n].iov_base = (char *)all[i].iov_base + skip;
+		iov[n].iov_len = all[i].iov_len - skip;
+		skip = 0;
+		n++;
+	}
+	return n;
+}
+//copies len bytes of a message's frame, starting at byte at, into out
+void message_read(message * msg, size_t at, unsigned char * out, size_t len)
+{
+	struct iovec iov[3];
+	int n = message_iov(msg, iov, at), i;
+	for (i = 0; i < n && len > 0; i++)
+	{
+		if (iov[i].iov_len > len)
+			iov[i].iov_len = len;
+		memcpy(out, iov[i].iov_base, iov[i].iov_len);
+		out += iov[i].iov_len;
+		len -= iov[i].iov_len;
+	}
+}
+//drops one reference, the last one frees the message
+//whichever reactor lets go last does the free
+void message_release(message * msg)
+{
+	if (atomic_fetch_sub_explicit(&msg->m_refs, 1, memory_order_acq_rel) == 1)
+	{
+		if (msg->m_segment != NULL)
+			segment_release(msg->m_segment);
+		if (msg->m_block != NULL)
+			rx_release(msg->m_block);
+		//every recipient has the chunk, its sender may send that much more
+		if (msg->m_stream != NULL)
+		{
+			mailbox_post(&reactors[msg->m_stream->m_reactor].m_mailbox, MAIL_CREDIT, NULL, msg->m_stream->m_sender,
+				NULL, msg->m_len - msg->m_head - msg->m_tail);
+			stream_release(msg->m_stream);
+		}
+		pool_free(msg);
+	}
+}
+//size bytes from the calling reactor's pool, rounded up to a size class
+//too big for the largest class (or not on a reactor): plain malloc()
+void *pool_alloc(size_t size)
+{
+	struct pool_class *pc;
+	pool_block *b;
+	uint32_t c = 0;
+	while (c < POOL_CLASSES && ((size_t)1 << (POOL_MIN_SHIFT + c)) < size + sizeof(pool_block))
+		c++;
+	if (c == POOL_CLASSES || current == NULL)
 	{
-		if ((clients[i].m_fd != 1) && (i != client_joining->m_index))
+		if ((b = malloc(sizeof(pool_block) + size)) == NULL)
 		{
-			write(clients[i].m_fd, write_buffer, BUFFER_SIZE);
+			perror("Server Error: Out of memory");
+			exit(1);
 		}
+		b->m_class = POOL_HEAP;
+		if (current != NULL)
+			current->m_pool_heap++;
+		return b + 1;
+	}
+	pc = &current->m_pool[c];
+	if (pc->m_free == NULL)
+		pool_refill(pc, c);
+	b = pc->m_free;
+	pc->m_free = b->m_next;
+	pc->m_in_use++;
+	return b + 1;
+}
+//gives a block back to the pool it came from, from any thread
+void pool_free(void * ptr)
+{
+	pool_block *b = (pool_block *)ptr - 1, *head;
+	struct pool_class *pc;
+	if (ptr == NULL)
+		return;
+	if (b->m_class == POOL_HEAP)
+	{
+		free(b);
+		return;
+	}
+	pc = &reactors[b->m_owner].m_pool[b->m_class];
+	if (current != NULL && current->m_id == (int)b->m_owner)
+	{
+		b->m_next = pc->m_free;
+		pc->m_free = b;
+		pc->m_in_use--;
+		return;
+	}
+	//another reactor's block, push it on that class's remote list
+	//(push only, the owner empties it with one exchange, so no ABA)
+	head = atomic_load_explicit(&pc->m_remote, memory_order_relaxed);
+	do
+		b->m_next = head;
+	while (!atomic_compare_exchange_weak_explicit(&pc->m_remote, &head, b, memory_order_release, memory_order_relaxed));
+}
+//refills an empty class, first with the blocks other reactors returned,
+//otherwise by cutting up a new slab (slabs are never given back)
+void pool_refill(struct pool_class * pc, uint32_t c)
+{
+	size_t size = (size_t)1 << (POOL_MIN_SHIFT + c), i;
+	unsigned char *slab;
+	pool_block *b;
+	if ((b = atomic_exchange_explicit(&pc->m_remote, NULL, memory_order_acquire)) != NULL)
+	{
+		pc->m_free = b;
+		for (; b != NULL; b = b->m_next)
+			pc->m_in_use--;
+		return;
+	}
+	if ((slab = malloc(POOL_SLAB)) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	for (i = 0; i + size <= POOL_SLAB; i += size)
+	{
+		b = (pool_block *)(slab + i);
+		b->m_class = c;
+		b->m_owner = current->m_id;
+		b->m_next = pc->m_free;
+		pc->m_free = b;
+		pc->m_carved++;
+	}
+	current->m_pool_bytes += POOL_SLAB;
+}
+//puts msg on the client's outbound queue (taking a reference)
+//a full queue means the client is not keeping up, config.slow_policy decides what gives
+void enqueue_message(session * client, message * msg)
+{
+	if (client->m_fd == EMPTY_CLIENT || client->m_dying)
+		return;
+	//a full ring doubles until it reaches config.queue_depth, only then is the client slow
+	if (client->m_q_count == client->m_q_cap && grow_queue(client) == -1 && make_queue_room(client) == -1)
+		return; //the client was disconnected
+	atomic_fetch_add_explicit(&msg->m_refs, 1, memory_order_relaxed);
+	client->m_queue[(client->m_q_head + client->m_q_count) % client->m_q_cap] = msg;
+	client->m_q_count++;
+	TRACE_RECORD(TRACE_ENQUEUE, msg->m_t_room);
+	METRIC_ADD(current->m_metrics.m_depth[metric_bucket(client->m_q_count)], 1);
+	METRIC_ADD(current->m_metrics.m_depth_sum, client->m_q_count);
+	//a blocked socket waits for EPOLLOUT; an idle one is written once the
+	//pass is over, or now if a whole writev() worth is already waiting
+	if (client->m_blocked)
+		return;
+	if (client->m_q_count >= FLUSH_IOV)
+	{
+		flush_client(client);
+		//io_uring would only start the writevs at the end of the pass, and
+		//report them after everything read in this one: a burst could fill
+		//the queue long before that
+		if (current->m_ring != NULL)
+		{
+			uring_enter(0, -1);
+			uring_reap_sends();
+		}
+	}
+	else
+		flush_later(client);
+}
+//doubles a full outbound ring, -1 if it is already config.queue_depth slots
+int grow_queue(session * client)
+{
+	size_t cap = client->m_q_cap * 2, i;
+	message **queue;
+	if (client->m_q_cap >= config.queue_depth)
+		return -1;
+	if (cap > config.queue_depth)
+		cap = config.queue_depth;
+	queue = pool_alloc(cap * sizeof(message *));
+	//unwrap the ring so the oldest frame lands in slot 0
+	for (i = 0; i < client->m_q_count; i++)
+		queue[i] = client->m_queue[(client->m_q_head + i) % client->m_q_cap];
+	pool_free(client->m_queue);
+	current->m_session_bytes += (cap - client->m_q_cap) * sizeof(message *);
+	client->m_queue = queue;
+	client->m_q_head = 0;
+	client->m_q_cap = cap;
+	return 0;
+}
+//frees at least one slot in a full queue
+// 0 -> there is room now
+//-1 -> the client had to be disconnected
+int make_queue_room(session * client)
+{
+	//a half-written frame has to finish, and so do the frames io_uring is
+	//writing; they are never dropped or merged
+	size_t first = client->m_q_busy > 0 ? client->m_q_busy : client->m_q_sent > 0 ? 1 : 0;
+	size_t drop = first, i;
+	//nor are stream chunks, ours or a peer's: a lost piece can take the
+	//sender's name or the end of the line with it, and a local chunk only
+	//earns its sender credit once it is written
+	while (drop < client->m_q_count && message_is_chunk(client->m_queue[(client->m_q_head + drop) % client->m_q_cap]))
+		drop++;
+	if (drop < client->m_q_count && config.slow_policy == POLICY_DROP_OLDEST)
+	{
+		message_release(client->m_queue[(client->m_q_head + drop) % client->m_q_cap]);
+		//keep the frames in front of it where they are
+		for (i = drop; i > 0; i--)
+			client->m_queue[(client->m_q_head + i) % client->m_q_cap] = client->m_queue[(client->m_q_head + i - 1) % client->m_q_cap];
+		client->m_q_head = (client->m_q_head + 1) % client->m_q_cap;
+		client->m_q_count--;
+		METRIC_ADD(current->m_slow.m_dropped, 1);
+		return 0;
+	}
+	if (drop < client->m_q_count && config.slow_policy == POLICY_COALESCE && coalesce_queue(client, first) == 0)
+	{
+		METRIC_ADD(current->m_slow.m_coalesced, 1);
+		return 0;
+	}
+	//disconnect, a coalesced backlog that grew past COALESCE_LIMIT, or a
+	//queue that is all being written or all stream chunks
+	METRIC_ADD(current->m_slow.m_disconnected, 1);
+	log_write(LOG_WARN, ">>%s is not keeping up, disconnecting", client->m_name);
+	schedule_drop(client);
+	return -1;
+}
+//merges each run of unsent frames from slot first onwards into one message,
+//stream chunks stay where they are on their own
+//frames are self-delimiting, so the client can not tell the difference
+//-1 if the merged backlog would be larger than COALESCE_LIMIT, or if no two
+//frames sit next to each other to be merged
+int coalesce_queue(session * client, size_t first)
+{
+	size_t i, j, k, out = first, total = 0, saved = 0, at;
+	message *merged, *msg, *prev = NULL;
+	for (i = first; i < client->m_q_count; i++)
+	{
+		msg = client->m_queue[(client->m_q_head + i) % client->m_q_cap];
+		if (!message_is_chunk(msg))
+		{
+			total += msg->m_len;
+			if (prev != NULL && !message_is_chunk(prev))
+				saved++;
+		}
+		prev = msg;
+	}
+	if (total > COALESCE_LIMIT || saved == 0)
+		return -1;
+	for (i = first; i < client->m_q_count; i = j)
+	{
+		//[i, j) is a run of plain frames, or a single chunk
+		msg = client->m_queue[(client->m_q_head + i) % client->m_q_cap];
+		total = msg->m_len;
+		for (j = i + 1; !message_is_chunk(msg) && j < client->m_q_count; j++)
+		{
+			if (message_is_chunk(client->m_queue[(client->m_q_head + j) % client->m_q_cap]))
+				break;
+			total += client->m_queue[(client->m_q_head + j) % client->m_q_cap]->m_len;
+		}
+		if (j - i > 1)
+		{
+			merged = message_alloc(total);
+			for (k = i, at = 0; k < j; k++)
+			{
+				msg = client->m_queue[(client->m_q_head + k) % client->m_q_cap];
+				message_read(msg, 0, merged->m_data + at, msg->m_len);
+				at += msg->m_len;
+				message_release(msg);
+			}
+			msg = merged;
+		}
+		//out never passes i, the slots behind it are free
+		client->m_queue[(client->m_q_head + out++) % client->m_q_cap] = msg;
+	}
+	client->m_q_count = out;
+	return 0;
+}
+//releases everything still queued for a client that is going away
+void clear_queue(session * client)
+{
+	while (client->m_q_count > 0)
+	{
+		message_release(client->m_queue[client->m_q_head]);
+		client->m_q_head = (client->m_q_head + 1) % client->m_q_cap;
+		client->m_q_count--;
+	}
+	client->m_q_head = 0;
+	client->m_q_sent = 0;
+	client->m_q_busy = 0;
+	client->m_blocked = 0;
+}
+//single recipient shortcut, encodes text and queues it for the client
+void queue_to_client(session * client, int type, const char * text)
+{
+	message *msg = message_create(type, text);
+	enqueue_message(client, msg);
+	message_release(msg);
+}
+//writes as much queued output as the socket will take without blocking,
+//up to FLUSH_IOV frames per writev(), the rest goes out on the next EPOLLOUT edge
+void flush_client(session * client)
+{
+	struct iovec iov[FLUSH_PARTS];
+	message *msg;
+	size_t i, count, want;
+	int parts;
+	int corked = 0, on = 1;
+	off_t offset;
+	ssize_t n;
+	if (current->m_ring != NULL)
+	{
+		uring_flush(client);
+		return;
+	}
+	if (client->m_dying)
+		return;
+	client->m_blocked = 0;
+	while (client->m_q_count > 0)
+	{
+		msg = client->m_queue[client->m_q_head];
+		if (msg->m_segment != NULL)
+		{
+			//replayed history, from the log file's page cache to the socket
+			offset = msg->m_offset + client->m_q_sent;
+			want = msg->m_len - client->m_q_sent;
+			n = sendfile(client->m_fd, msg->m_segment->m_fd, &offset, want);
+		}
+		else
+		{
+			count = client->m_q_count < FLUSH_IOV ? client->m_q_count : FLUSH_IOV;
+			for (i = 0, parts = 0; i < count; i++)
+			{
+				msg = client->m_queue[(client->m_q_head + i) % client->m_q_cap];
+				//stop at replayed history, it goes out on its own
+				if (msg->m_segment != NULL)
+					break;
+				//skip what an earlier short write already sent
+				parts += message_iov(msg, iov + parts, i == 0 ? client->m_q_sent : 0);
+			}
+			for (count = 0, want = 0; count < (size_t)parts; count++)
+				want += iov[count].iov_len;
+			n = writev(client->m_fd, iov, parts);
+		}
+		METRIC_ADD(current->m_metrics.m_writes, 1);
+		METRIC_ADD(current->m_metrics.m_syscalls, 1);
+		if (n > 0)
+		{
+			METRIC_ADD(current->m_metrics.m_bytes_out, n);
+			pop_sent(client, n);
+			//everything went and more is queued: this flush takes several
+			//calls, so hold back partial packets until the last one
+			if (!corked && (size_t)n == want && client->m_q_count > 0)
+			{
+				corked = setsockopt(client->m_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0;
+				METRIC_ADD(current->m_metrics.m_syscalls, 1);
+			}
+		}
+		else if (n == -1 && errno == EINTR)
+			continue;
+		else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			client->m_blocked = 1;
+			break;
+		}
+		else
+		{
+			//broken connection, drop the client once this pass is over
+			schedule_drop(client);
+			return;
+		}
+	}
+	if (corked)
+	{
+		on = 0;
+		setsockopt(client->m_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+		METRIC_ADD(current->m_metrics.m_syscalls, 1);
+	}
+	if (client->m_blocked)
+		return;
+	//the exit directive is out, the client can go
+	if (client->m_state == STATE_CLOSING)
+		close_client(client);
+}
+//where a message's frame bytes are, in memory or in a mapped log segment
+unsigned char *message_bytes(message * msg)
+{
+	return msg->m_segment != NULL ? msg->m_segment->m_map + msg->m_offset : msg->m_data;
+}
+//decodes a message's frame header, returns the payload and fills in its type and length
+const unsigned char *message_payload(message * msg, int * type, size_t * len)
+{
+	const unsigned char *p = message_bytes(msg);
+	size_t n = 0, i = 0;
+	int shift = 0;
+	do
+	{
+		n |= (size_t)(p[i] & 0x7f) << shift;
+		shift += 7;
+	} while (p[i++] & 0x80);
+	*type = p[i];
+	*len = n;
+	return p + i + 1;
+}
+//a piece of a streamed message, ours or relayed by a peer; these are never
+//dropped or merged for a slow recipient
+int message_is_chunk(message * msg)
+{
+	size_t len;
+	int type;
+	message_payload(msg, &type, &len);
+	return type == FRAME_CHUNK || type == FRAME_CHUNK_END;
+}
+//releases the frames a writev() fully sent, remembers how far into
+//the next one it got
+void pop_sent(session * client, size_t n)
+{
+	message *msg;
+	while (n > 0)
+	{
+		msg = client->m_queue[client->m_q_head];
+		if (n < msg->m_len - client->m_q_sent)
+		{
+			client->m_q_sent += n;
+			return;
+		}
+		n -= msg->m_len - client->m_q_sent;
+		client->m_q_sent = 0;
+		client->m_q_head = (client->m_q_head + 1) % client->m_q_cap;
+		client->m_q_count--;
+		TRACE_RECORD(TRACE_WRITE, msg->m_t_room);
+		TRACE_RECORD(TRACE_TOTAL, msg->m_t_read);
+		message_release(msg);
+		METRIC_ADD(current->m_metrics.m_msgs_out, 1);
+		if (current->m_phase != SHUTDOWN_NONE)
+			current->m_shutdown.m_flushed++;
+	}
+}
+//this function will send text
+//to all other users in the sender's room
+void send_to_clients(session * sender, const char * text)
+{
+	if (current->m_phase != SHUTDOWN_DRAIN) // prevents some bogus output
+	{
+		message *msg;
+		//goes to the log ring, the flusher thread does the actual output
+		log_write(LOG_INFO, "[%s] %s> %s", sender->m_room->m_name, sender->m_name, text);
+		//format it once as name> message, every recipient just gets a reference
+		//a long line is not even copied, the message points at where it was read
+		if (current->m_slice_block != NULL)
+		{
+			char head[NICK_SIZE + 2];
+			size_t head_len = snprintf(head, sizeof(head), "%s> ", sender->m_name);
+			msg = message_slice(FRAME_TEXT, head, head_len, current->m_slice_block, current->m_slice,
+				current->m_slice_len, "\n");
+		}
+		else
+			msg = message_printf(FRAME_TEXT, "%s> %s\n", sender->m_name, text);
+#ifdef CHAT_TRACE
+		//stamped before anyone else can see the message, the scrollback included
+		msg->m_t_read = current->m_t_read;
+		msg->m_t_parse = current->m_t_parse;
+		TRACE_RECORD(TRACE_ROOM, msg->m_t_parse);
+		TRACE_STAMP(msg->m_t_room);
+#endif
+		room_record(sender->m_room, msg);
+		//send message to everyone else in the room
+		broadcast_to_room(sender->m_room, sender, msg);
+		message_release(msg);
+	}
+}
+//one piece of a message the client streams: it goes to the room as soon as
+//it is read, straight out of the receive block, and is credited back once
+//every recipient has it, so a paste of any size holds at most STREAM_WINDOW
+//bytes here whatever the number of recipients
+void stream_piece(session * client, int last, rx_block * b, const char * piece, size_t len)
+{
+	stream *s = client->m_stream;
+	client->m_owed += len;
+	if (client->m_state != STATE_CHAT || client->m_room == NULL || current->m_phase == SHUTDOWN_DRAIN)
+	{
+		credit_client(client, len); //nobody to pass it to
+		if (last)
+			stream_end(client);
+		return;
+	}
+	if (s == NULL)
+	{
+		s = pool_alloc(sizeof(stream));
+		atomic_init(&s->m_refs, 1);
+		s->m_reactor = current->m_id;
+		s->m_sender = session_handle_of(client);
+		//mixed with the node id, so streams from other nodes of a cluster do not clash
+		s->m_id = link_node ^ atomic_fetch_add(&stream_count, 1);
+		s->m_bytes = s->m_pieces = 0;
+		s->m_ended = 0;
+		client->m_stream = s;
+		METRIC_ADD(current->m_metrics.m_streams, 1);
+	}
+	if (!s->m_ended && s->m_bytes + len > STREAM_MAX)
+	{
+		//what the others got so far still ends as a line
+		stream_send(client, FRAME_CHUNK_END, NULL, NULL, 0);
+		s->m_ended = 1;
+		queue_to_client(client, FRAME_NOTICE, ">>Your message was too long, the rest of it was dropped.\n");
+	}
+	if (s->m_ended)
+		credit_client(client, len);
+	else
+		stream_send(client, last ? FRAME_CHUNK_END : FRAME_CHUNK, b, piece, len);
+	if (last)
+	{
+		s->m_ended = 1;
+		stream_end(client);
+	}
+}
+//passes one piece of the client's stream to its room: the stream id, the
+//name in front of the first piece and a newline after the last one
+void stream_send(session * client, int type, rx_block * b, const char * piece, size_t len)
+{
+	unsigned char head[STREAM_ID_SIZE + NICK_SIZE + 2];
+	stream *s = client->m_stream;
+	size_t head_len = STREAM_ID_SIZE;
+	message *msg;
+	frame_put_le(head, s->m_id, STREAM_ID_SIZE);
+	if (s->m_pieces++ == 0)
+		head_len += snprintf((char *)head + head_len, sizeof(head) - head_len, "%s> ", client->m_name);
+	msg = message_slice(type, head, head_len, len > 0 ? b : NULL, piece, len, type == FRAME_CHUNK_END ? "\n" : "");
+	if (len > 0)
+	{
+		//credited from message_release(), wherever the last recipient is
+		atomic_fetch_add_explicit(&s->m_refs, 1, memory_order_relaxed);
+		msg->m_stream = s;
+	}
+	s->m_bytes += len;
+	METRIC_ADD(current->m_metrics.m_stream_bytes, len);
+	//never recorded: a paste of megabytes does not belong in the scrollback
+	broadcast_to_room(client->m_room, client, msg);
+	message_release(msg);
+}
+//the client's stream is over: it finished, left the room or went away
+//one that broke off mid-message is closed with a newline for the others
+void stream_end(session * client)
+{
+	stream *s = client->m_stream;
+	if (s == NULL)
+		return;
+	if (s->m_pieces > 0 && !s->m_ended && current->m_phase != SHUTDOWN_DRAIN && client->m_room != NULL)
+		stream_send(client, FRAME_CHUNK_END, NULL, NULL, 0);
+	log_write(LOG_INFO, "[%s] %s> (%zu bytes streamed)", client->m_room != NULL ? client->m_room->m_name : "",
+		client->m_name, s->m_bytes);
+	client->m_stream = NULL;
+	stream_release(s);
+}
+void stream_release(stream * s)
+{
+	if (atomic_fetch_sub_explicit(&s->m_refs, 1, memory_order_acq_rel) == 1)
+		pool_free(s);
+}
+//bytes more of the client's chunks reached everyone: tells the client the
+//new running total, which reopens that much of its window
+void credit_client(session * client, uint32_t bytes)
+{
+	unsigned char total[4];
+	message *msg;
+	client->m_owed -= bytes;
+	client->m_credited += bytes;
+	frame_put_le(total, client->m_credited, sizeof(total));
+	msg = message_alloc(FRAME_HEADER_MAX + sizeof(total));
+	msg->m_len = frame_encode(msg->m_data, FRAME_HEADER_MAX + sizeof(total), FRAME_CREDIT, total, sizeof(total));
+	enqueue_message(client, msg);
+	message_release(msg);
+}
+//Cntrl-C
+//blocks SIGINT and SIGTERM and returns a signalfd that delivers them, so
+//the shutdown runs on an ordinary thread instead of in a signal handler
+int shutdown_signals()
+{
+	sigset_t mask;
+	int sfd;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0 || (sfd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1)
+	{
+		perror("Server Error: signalfd failed");
+		exit(1);
+	}
+	return sfd;
+}
+//the main thread's part of a shutdown: waits for the signal, tells the
+//clients, gives them config.shutdown_grace seconds to leave on their own
+//and then has the reactors send the exit directive and drain
+void shutdown_wait(int sfd)
+{
+	struct signalfd_siginfo info;
+	struct pollfd pfd = { sfd, POLLIN }, wait[2] = { { sfd, POLLIN }, { handoff_listen_fd, POLLIN } };
+	uint64_t end;
+	int64_t left;
+	//a signal, or a new server asking for our clients (poll skips fd -1)
+	for (;;)
+	{
+		if (poll(wait, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("Server Error: poll failed");
+			exit(1);
+		}
+		if ((wait[1].revents & POLLIN) && (handoff_peer = accept(handoff_listen_fd, NULL, NULL)) != -1)
+		{
+			shutdown_started = now_ns();
+			log_write(LOG_INFO, ">>A new server is taking over, handing off");
+			close(handoff_listen_fd);
+			shutdown_advance(SHUTDOWN_HANDOFF);
+			close(sfd);
+			return;
+		}
+		if ((wait[0].revents & POLLIN) && read(sfd, &info, sizeof(info)) == sizeof(info))
+			break;
+	}
+	//plain shutdown, nobody takes over
+	if (handoff_listen_fd != -1)
+	{
+		close(handoff_listen_fd);
+		unlink(config.handoff_path);
+	}
+	shutdown_started = now_ns();
+	printf("\n>>The Server will shut down in %d seconds.\n\n", config.shutdown_grace);
+	fflush(stdout); //ensures that message is printed to server terminal
+	shutdown_advance(SHUTDOWN_NOTICE);
+	//wait out the grace period, allows users to exit manually if desired
+	//a second signal cuts it short
+	end = shutdown_started + (uint64_t)config.shutdown_grace * 1000000000u;
+	while ((left = (int64_t)(end - now_ns())) > 0)
+	{
+		if (poll(&pfd, 1, (int)((left + 999999) / 1000000)) == 1 && read(sfd, &info, sizeof(info)) == sizeof(info))
+		{
+			log_write(LOG_WARN, ">>Second signal, shutting down now");
+			break;
+		}
+	}
+	shutdown_advance(SHUTDOWN_DRAIN);
+	close(sfd);
+}
+//moves every reactor on to the given phase, they act on it when they wake
+void shutdown_advance(int phase)
+{
+	uint64_t one = 1;
+	int r;
+	atomic_store(&shutdown_phase, phase);
+	for (r = 0; r < config.reactors; r++)
+		write(reactors[r].m_mailbox.m_wake_fd, &one, sizeof(one));
+}
+//a reactor catching up with shutdown_phase, through the normal outbound queues
+void shutdown_step()
+{
+	int phase = atomic_load(&shutdown_phase);
+	message *notice, *quit;
+	session *client;
+	size_t i;
+	if (phase == SHUTDOWN_HANDOFF)
+	{
+		//the new server carries an interrupted paste on under a new stream
+		//id, so the rooms see this one end while the links are still up
+		for (i = 0; i < current->m_slot_count; i++)
+		{
+			client = session_at(i);
+			if (client->m_fd != EMPTY_CLIENT)
+				stream_end(client);
+		}
+		current->m_phase = phase;
+		return;
+	}
+	if (current->m_phase == SHUTDOWN_NONE)
+	{
+		//no new clients, the ones still in the backlog are reset
+		if (current->m_ring != NULL)
+			uring_cancel(URING_DATA(URING_ACCEPT, 0));
+		close(current->m_listen_fd);
+		current->m_listen_fd = -1;
+		current->m_accept_waiting = 0;
+		notice = message_printf(FRAME_NOTICE, ">>The Server will shut down in %d seconds.\n", config.shutdown_grace);
+		for (i = 0; i < current->m_slot_count; i++)
+		{
+			client = session_at(i);
+			if (client->m_fd != EMPTY_CLIENT && client->m_state != STATE_CLOSING)
+				enqueue_message(client, notice);
+		}
+		message_release(notice);
+		current->m_phase = SHUTDOWN_NOTICE;
+	}
+	if (current->m_phase == SHUTDOWN_NOTICE && phase == SHUTDOWN_DRAIN)
+	{
+		//everyone is leaving, so nobody needs to hear about anybody else
+		quit = message_create(FRAME_QUIT, "");
+		current->m_phase = SHUTDOWN_DRAIN;
+		for (i = 0; i < current->m_slot_count; i++)
+		{
+			client = session_at(i);
+			if (client->m_fd == EMPTY_CLIENT || client->m_state == STATE_CLOSING)
+				continue;
+			if (client->m_room != NULL)
+				room_leave(client);
+			//each is closed by flush_client() once the directive is out
+			client->m_state = STATE_CLOSING;
+			enqueue_message(client, quit);
+		}
+		message_release(quit);
+		current->m_deadline = now_ns() + (uint64_t)config.shutdown_drain * 1000000u;
+		reap_clients();
+	}
+}
+//the drain deadline passed, closes whoever still has output waiting
+void shutdown_cut_off()
+{
+	session *client;
+	size_t i;
+	for (i = 0; i < current->m_slot_count; i++)
+	{
+		client = session_at(i);
+		if (client->m_fd == EMPTY_CLIENT)
+			continue;
+		current->m_shutdown.m_cut_clients++;
+		current->m_shutdown.m_cut_frames += client->m_q_count;
+		close_client(client);
+	}
+}
+//-U: listens for the server that will replace us, shutdown_wait() watches it
+void handoff_listen()
+{
+	struct sockaddr_un addr = { AF_UNIX };
+	strcpy(addr.sun_path, config.handoff_path);
+	//the path may still name the socket of the server we took over from
+	unlink(config.handoff_path);
+	if ((handoff_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+		|| bind(handoff_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| listen(handoff_listen_fd, 1) == -1)
+	{
+		perror("Server Error: Handoff socket failed");
+		exit(1);
+	}
+}
+//-U: asks a running server for its sockets, fills in handoff_listeners and
+//returns the connection to read the clients from, -1 if nobody is running
+//blocks until the old server has stopped its reactors and trimmed its logs
+int handoff_connect()
+{
+	struct sockaddr_un addr = { AF_UNIX };
+	struct handoff_header header;
+	int sd, n;
+	strcpy(addr.sun_path, config.handoff_path);
+	if ((sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+	{
+		perror("Server Error: Handoff socket failed");
+		exit(1);
+	}
+	if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	{
+		close(sd);
+		return -1; //first server on this path, start from scratch
+	}
+	if ((n = handoff_recv(sd, &header, sizeof(header), handoff_listeners, MAX_REACTORS)) == -1
+		|| header.m_magic != HANDOFF_MAGIC || (uint32_t)n != header.m_listeners)
+	{
+		//it went away or is shutting down instead
+		log_write(LOG_WARN, "Server Error: No handoff from %s, starting fresh", config.handoff_path);
+		while (n > 0)
+			close(handoff_listeners[--n]);
+		close(sd);
+		return -1;
+	}
+	handoff_listener_count = n;
+	return sd;
+}
+//-U: adopts the old server's clients, before any reactor runs
+//they are dealt out over the reactors, rejoin their rooms without any
+//announcement and get their unsent output and half-read frame back
+void handoff_take(int sd)
+{
+	char notice[FRAME_MAX_PAYLOAD];
+	struct handoff_session rec;
+	struct frame_reader *in;
+	char *body;
+	size_t body_len, adopted = 0, dropped = 0;
+	unsigned char *space;
+	size_t space_len;
+	session *client;
+	message *msg;
+	int fd, n, r = 0;
+	for (;;)
+	{
+		if ((n = handoff_recv(sd, &rec, sizeof(rec), &fd, 1)) == -1)
+		{
+			perror("Server Error: Handoff broke off");
+			exit(1);
+		}
+		if (rec.m_state == HANDOFF_END)
+			break;
+		if (n != 1)
+		{
+			fprintf(stderr, "Server Error: Handoff record without its socket\n");
+			exit(1);
+		}
+		body_len = (size_t)rec.m_name_len + 1 + rec.m_room_len + 1 + rec.m_in_len + rec.m_out_len;
+		if ((body = malloc(body_len)) == NULL)
+		{
+			perror("Server Error: Out of memory");
+			exit(1);
+		}
+		if (read_full(sd, body, rec.m_name_len) == -1
+			|| read_full(sd, body + rec.m_name_len + 1, rec.m_room_len) == -1
+			|| read_full(sd, body + rec.m_name_len + 1 + rec.m_room_len + 1, rec.m_in_len + rec.m_out_len) == -1)
+		{
+			perror("Server Error: Handoff broke off");
+			exit(1);
+		}
+		body[rec.m_name_len] = '\0';
+		body[rec.m_name_len + 1 + rec.m_room_len] = '\0';
+		//a half-read frame we can not hold would leave the client's stream
+		//out of step, it is better off reconnecting
+		if (rec.m_in_len > RX_READ_MIN)
+		{
+			close(fd);
+			dropped++;
+			free(body);
+			continue;
+		}
+		//round robin, the main thread stands in for each reactor in turn
+		current = &reactors[r];
+		r = (r + 1) % config.reactors;
+		//client_open() closes the socket if there is no room for it
+		if ((client = client_open(fd)) == NULL)
+		{
+			dropped++;
+			free(body);
+			continue;
+		}
+		client->m_state = rec.m_state;
+		//names were unique on the old server; should one come twice anyway,
+		//its second owner picks another before getting back into a room;
+		//one on its way out keeps its name for the log but does not hold it
+		if (rec.m_state == STATE_CHAT && nick_claim(body, client) == 0)
+			set_name(client, body);
+		else if (rec.m_state == STATE_CLOSING)
+			set_name(client, body);
+		else if (rec.m_state == STATE_CHAT)
+		{
+			client->m_state = STATE_NAME;
+			rec.m_room_len = 0;
+			snprintf(notice, sizeof(notice), ">>%s is already taken, please pick another name.\n", body);
+			queue_to_client(client, FRAME_NOTICE, notice);
+		}
+		if (rec.m_room_len > 0)
+			room_join(client, room_find(body + rec.m_name_len + 1, 1));
+		if (rec.m_in_len > 0)
+		{
+			in = rx_reader(client);
+			space = frame_reader_space(in, &space_len);
+			memcpy(space, body + body_len - rec.m_out_len - rec.m_in_len, rec.m_in_len);
+			frame_reader_commit(in, rec.m_in_len);
+			keep_partial_frame(client, in);
+		}
+		//frames are self-delimiting, the whole backlog can go out as one message
+		if (rec.m_out_len > 0)
+		{
+			msg = message_alloc(rec.m_out_len);
+			memcpy(msg->m_data, body + body_len - rec.m_out_len, rec.m_out_len);
+			enqueue_message(client, msg);
+			message_release(msg);
+		}
+		//a stream in flight carries on as a new one, with its whole window back
+		client->m_credited = rec.m_credited;
+		if (rec.m_credited != 0)
+			credit_client(client, 0);
+		//a client that was leaving goes once its exit directive is out
+		flush_client(client);
+		reap_clients();
+		free(body);
+		adopted++;
+	}
+	current = NULL;
+	close(sd);
+	log_write(LOG_INFO, ">>Took over %d listeners and %zu clients from the old server (%zu dropped)",
+		handoff_listener_count, adopted, dropped);
+}
+//the old server's part of a handoff, after the reactors stopped: passes the
+//listeners, then each client with its socket, name, room, partial frame and
+//unsent output; our copies of the sockets close when the process exits
+void handoff_give()
+{
+	struct handoff_header header = { HANDOFF_MAGIC, config.reactors };
+	struct handoff_session rec;
+	struct iovec iov[3];
+	int listeners[MAX_REACTORS], r, parts, p;
+	session *client;
+	message *msg;
+	size_t i, q;
+	for (r = 0; r < config.reactors; r++)
+	{
+		listeners[r] = reactors[r].m_listen_fd;
+		//broadcasts posted after their reactor stopped still belong in the queues
+		current = &reactors[r];
+		drain_mailbox();
+		reap_clients();
+	}
+	if (handoff_send(handoff_peer, &header, sizeof(header), listeners, config.reactors) == -1)
+	{
+		perror("Server Error: Handoff failed");
+		exit(1);
+	}
+	for (r = 0; r < config.reactors; r++)
+	{
+		current = &reactors[r];
+		for (i = 0; i < current->m_slot_count; i++)
+		{
+			client = session_at(i);
+			if (client->m_fd == EMPTY_CLIENT)
+				continue;
+			rec.m_state = client->m_state;
+			rec.m_name_len = strlen(client->m_name);
+			rec.m_room_len = client->m_room != NULL ? strlen(client->m_room->m_name) : 0;
+			rec.m_in_len = client->m_in.m_buf != NULL ? client->m_in.m_len - client->m_in.m_start : 0;
+			rec.m_credited = client->m_credited + client->m_owed;
+			rec.m_out_len = 0;
+			for (q = 0; q < client->m_q_count; q++)
+				rec.m_out_len += client->m_queue[(client->m_q_head + q) % client->m_q_cap]->m_len;
+			rec.m_out_len -= client->m_q_sent;
+			if (handoff_send(handoff_peer, &rec, sizeof(rec), &client->m_fd, 1) == -1
+				|| write_full(handoff_peer, client->m_name, rec.m_name_len) == -1
+				|| (rec.m_room_len > 0 && write_full(handoff_peer, client->m_room->m_name, rec.m_room_len) == -1)
+				|| (rec.m_in_len > 0 && write_full(handoff_peer, client->m_in.m_buf + client->m_in.m_start, rec.m_in_len) == -1))
+			{
+				perror("Server Error: Handoff failed");
+				exit(1);
+			}
+			//the first frame may be partly written already
+			for (q = 0; q < client->m_q_count; q++)
+			{
+				msg = client->m_queue[(client->m_q_head + q) % client->m_q_cap];
+				parts = message_iov(msg, iov, q == 0 ? client->m_q_sent : 0);
+				for (p = 0; p < parts; p++)
+				{
+					if (write_full(handoff_peer, iov[p].iov_base, iov[p].iov_len) == -1)
+					{
+						perror("Server Error: Handoff failed");
+						exit(1);
+					}
+				}
+			}
+			handoff_sessions++;
+			handoff_bytes += rec.m_out_len;
+		}
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.m_state = HANDOFF_END;
+	if (handoff_send(handoff_peer, &rec, sizeof(rec), NULL, 0) == -1)
+	{
+		perror("Server Error: Handoff failed");
+		exit(1);
+	}
+	current = NULL;
+	close(handoff_peer);
+	log_write(LOG_INFO, ">>Handed %zu clients over to the new server", handoff_sessions);
+}
+//sends one record with nfds descriptors attached, 0 on success
+//a short sendmsg() is finished with plain writes, -1 if that fails
+int handoff_send(int sd, const void * buf, size_t len, const int * fds, int nfds)
+{
+	char control[CMSG_SPACE(MAX_REACTORS * sizeof(int))];
+	struct iovec iov = { (void *)buf, len };
+	struct msghdr mh = { 0 };
+	struct cmsghdr *c;
+	ssize_t n;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (nfds > 0)
+	{
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		c = CMSG_FIRSTHDR(&mh);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+	}
+	//the descriptors ride on the first byte, the rest may follow separately
+	while ((n = sendmsg(sd, &mh, 0)) == -1 && errno == EINTR)
+		;
+	if (n == -1)
+		return -1;
+	return write_full(sd, (const char *)buf + n, len - n);
+}
+//reads one record and the descriptors that came with it (at most max)
+//returns how many descriptors arrived, -1 if the stream broke
+int handoff_recv(int sd, void * buf, size_t len, int * fds, int max)
+{
+	char control[CMSG_SPACE(MAX_REACTORS * sizeof(int))];
+	struct iovec iov = { buf, len };
+	struct msghdr mh = { 0 };
+	struct cmsghdr *c;
+	ssize_t n;
+	int count = 0;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = CMSG_SPACE(max * sizeof(int));
+	while ((n = recvmsg(sd, &mh, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+		;
+	if (n <= 0)
+		return -1;
+	for (c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c))
+	{
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+		{
+			count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(c), count * sizeof(int));
+		}
+	}
+	if ((size_t)n < len && read_full(sd, (char *)buf + n, len - n) == -1)
+		return -1;
+	return count;
+}
+//-M: binds the loopback metrics port and starts the thread that serves it
+//SO_REUSEPORT lets a replacement server (-U) bind it while we still run
+void metrics_start()
+{
+	struct sockaddr_in addr = { AF_INET, htons(config.metrics_port) };
+	int on = 1;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+		|| setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+		|| setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1
+		|| bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| listen(metrics_fd, 16) == -1)
+	{
+		perror("Server Error: Metrics socket failed");
+		exit(1);
+	}
+	if (pthread_create(&metrics_thread, NULL, metrics_main, NULL) != 0)
+	{
+		perror("Error Creating Thread\n");
+		exit(1);
+	}
+}
+void metrics_stop()
+{
+	atomic_store(&metrics_stopping, 1);
+	pthread_join(metrics_thread, NULL);
+	close(metrics_fd);
+}
+//the metrics thread: answers every connection with one scrape, whatever
+//was asked for, and closes it (HTTP/1.0)
+void *metrics_main(void * arg)
+{
+	struct pollfd pfd = { metrics_fd, POLLIN };
+	struct metrics_buf out = { NULL, 0, 0 };
+	struct timeval timeout = { 1, 0 };
+	char request[1024], header[128];
+	int fd, len;
+	while (!atomic_load(&metrics_stopping))
+	{
+		if (poll(&pfd, 1, METRICS_POLL_MS) != 1 || (fd = accept(metrics_fd, NULL, NULL)) == -1)
+			continue;
+		//a scraper that never sends its request can not hold us up for long
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		read(fd, request, sizeof(request));
+		out.m_len = 0;
+		metrics_scrape(&out);
+		len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", out.m_len);
+		if (write_full(fd, header, len) == -1 || write_full(fd, out.m_data, out.m_len) == -1)
+			log_write(LOG_DEBUG, "Metrics scrape cut short: %s", strerror(errno));
+		close(fd);
+	}
+	free(out.m_data);
+	return NULL;
+}
+//adds up every reactor's counters into the Prometheus text format
+//the reactors keep running, so each value is a moment's snapshot
+void metrics_scrape(struct metrics_buf * out)
+{
+	unsigned long total[9] = { 0 }, slow[3] = { 0 }, buckets[METRIC_BUCKETS], depth[METRIC_BUCKETS] = { 0 };
+	unsigned long opened, closed, depth_sum = 0;
+	struct reactor_metrics *m;
+	char labels[32];
+	int r, b;
+	for (r = 0; r < config.reactors; r++)
+	{
+		m = &reactors[r].m_metrics;
+		total[0] += atomic_load_explicit(&m->m_accepts, memory_order_relaxed);
+		total[1] += atomic_load_explicit(&m->m_msgs_in, memory_order_relaxed);
+		total[2] += atomic_load_explicit(&m->m_msgs_out, memory_order_relaxed);
+		total[3] += atomic_load_explicit(&m->m_bytes_in, memory_order_relaxed);
+		total[4] += atomic_load_explicit(&m->m_bytes_out, memory_order_relaxed);
+		total[5] += atomic_load_explicit(&m->m_writes, memory_order_relaxed);
+		total[6] += atomic_load_explicit(&m->m_syscalls, memory_order_relaxed);
+		total[7] += atomic_load_explicit(&m->m_streams, memory_order_relaxed);
+		total[8] += atomic_load_explicit(&m->m_stream_bytes, memory_order_relaxed);
+		slow[0] += atomic_load_explicit(&reactors[r].m_slow.m_dropped, memory_order_relaxed);
+		slow[1] += atomic_load_explicit(&reactors[r].m_slow.m_coalesced, memory_order_relaxed);
+		slow[2] += atomic_load_explicit(&reactors[r].m_slow.m_disconnected, memory_order_relaxed);
+		for (b = 0; b < METRIC_BUCKETS; b++)
+			depth[b] += atomic_load_explicit(&m->m_depth[b], memory_order_relaxed);
+		depth_sum += atomic_load_explicit(&m->m_depth_sum, memory_order_relaxed);
+	}
+	metrics_printf(out, "# HELP chat_sessions Connected clients, per reactor.\n# TYPE chat_sessions gauge\n");
+	for (r = 0; r < config.reactors; r++)
+	{
+		m = &reactors[r].m_metrics;
+		//closed first, so a session opened in between can not make it negative
+		closed = atomic_load_explicit(&m->m_closed, memory_order_relaxed);
+		opened = atomic_load_explicit(&m->m_opened, memory_order_relaxed);
+		metrics_printf(out, "chat_sessions{reactor=\"%d\"} %lu\n", r, opened - closed);
+	}
+	//rates (accepts/s, messages/s) are rate() over these counters
+	metrics_printf(out, "# HELP chat_accepts_total Connections accepted.\n# TYPE chat_accepts_total counter\n"
+		"chat_accepts_total %lu\n", total[0]);
+	metrics_printf(out, "# HELP chat_messages_received_total Frames read from clients.\n"
+		"# TYPE chat_messages_received_total counter\nchat_messages_received_total %lu\n", total[1]);
+	metrics_printf(out, "# HELP chat_messages_sent_total Frames written to clients.\n"
+		"# TYPE chat_messages_sent_total counter\nchat_messages_sent_total %lu\n", total[2]);
+	metrics_printf(out, "# HELP chat_bytes_received_total Bytes read from clients.\n"
+		"# TYPE chat_bytes_received_total counter\nchat_bytes_received_total %lu\n", total[3]);
+	metrics_printf(out, "# HELP chat_bytes_sent_total Bytes written to clients.\n"
+		"# TYPE chat_bytes_sent_total counter\nchat_bytes_sent_total %lu\n", total[4]);
+	metrics_printf(out, "# HELP chat_write_calls_total writev() and sendfile() calls to clients.\n"
+		"# TYPE chat_write_calls_total counter\nchat_write_calls_total %lu\n", total[5]);
+	metrics_printf(out, "# HELP chat_io_syscalls_total Syscalls the reactors made to wait for and move client bytes.\n"
+		"# TYPE chat_io_syscalls_total counter\nchat_io_syscalls_total{backend=\"%s\"} %lu\n",
+		config.backend == BACKEND_URING ? "uring" : "epoll", total[6]);
+	metrics_printf(out, "# HELP chat_streams_total Messages clients streamed in chunks.\n"
+		"# TYPE chat_streams_total counter\nchat_streams_total %lu\n", total[7]);
+	metrics_printf(out, "# HELP chat_stream_bytes_total Chunk bytes passed on to the rooms.\n"
+		"# TYPE chat_stream_bytes_total counter\nchat_stream_bytes_total %lu\n", total[8]);
+	metrics_printf(out, "# HELP chat_slow_consumer_total Times a full outbound queue had to give.\n"
+		"# TYPE chat_slow_consumer_total counter\n"
+		"chat_slow_consumer_total{action=\"drop\"} %lu\nchat_slow_consumer_total{action=\"coalesce\"} %lu\n"
+		"chat_slow_consumer_total{action=\"disconnect\"} %lu\n", slow[0], slow[1], slow[2]);
+	//1 us up to about 1 s
+	metrics_printf(out, "# HELP chat_loop_seconds Time a reactor spent handling one batch of events.\n"
+		"# TYPE chat_loop_seconds histogram\n");
+	for (r = 0; r < config.reactors; r++)
+	{
+		m = &reactors[r].m_metrics;
+		for (b = 0; b < METRIC_BUCKETS; b++)
+			buckets[b] = atomic_load_explicit(&m->m_loop[b], memory_order_relaxed);
+		snprintf(labels, sizeof(labels), "reactor=\"%d\",", r);
+		metrics_histogram(out, "chat_loop_seconds", labels, buckets, 9, 29, 1e-9, 0,
+			atomic_load_explicit(&m->m_loop_sum, memory_order_relaxed) / 1e9);
+	}
+	metrics_printf(out, "# HELP chat_queue_depth Frames in a client's outbound queue right after an enqueue.\n"
+		"# TYPE chat_queue_depth histogram\n");
+	metrics_histogram(out, "chat_queue_depth", "", depth, 0, metric_bucket(config.queue_depth), 1, 1, depth_sum);
+}
+//appends to the scrape, growing it as needed
+void metrics_printf(struct metrics_buf * out, const char * format, ...)
+{
+	va_list args;
+	size_t room;
+	int len;
+	for (;;)
+	{
+		room = out->m_cap - out->m_len;
+		va_start(args, format);
+		len = vsnprintf(out->m_data + out->m_len, room, format, args);
+		va_end(args);
+		if ((size_t)len < room)
+			break;
+		out->m_cap = out->m_cap ? out->m_cap * 2 : 4096;
+		if ((out->m_data = realloc(out->m_data, out->m_cap)) == NULL)
+		{
+			perror("Server Error: Out of memory");
+			exit(1);
+		}
+	}
+	out->m_len += len;
+}
+//writes a power-of-two histogram with buckets first..last as le bounds,
+//everything below first counts towards it, everything above only to +Inf
+//integral values top out at 2^(b+1) - 1, the others at 2^(b+1), times scale
+void metrics_histogram(struct metrics_buf * out, const char * name, const char * labels, unsigned long * buckets,
+	int first, int last, double scale, int integral, double sum)
+{
+	unsigned long seen = 0;
+	int b;
+	for (b = 0; b < METRIC_BUCKETS; b++)
+	{
+		seen += buckets[b];
+		if (b >= first && b <= last)
+			metrics_printf(out, "%s_bucket{%sle=\"%g\"} %lu\n", name, labels,
+				((double)((uint64_t)2 << b) - integral) * scale, seen);
+	}
+	metrics_printf(out, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, labels, seen);
+	//labels end in a comma, the _sum and _count lines need them without it
+	if (labels[0] != '\0')
+	{
+		metrics_printf(out, "%s_sum{%.*s} %g\n%s_count{%.*s} %lu\n", name, (int)strlen(labels) - 1, labels, sum,
+			name, (int)strlen(labels) - 1, labels, seen);
+	}
+	else
+		metrics_printf(out, "%s_sum %g\n%s_count %lu\n", name, sum, name, seen);
+}
+//histogram bucket of a value, bucket b holds [2^b, 2^(b+1))
+int metric_bucket(uint64_t value)
+{
+	int b = value ? 63 - __builtin_clzll(value) : 0;
+	return b < METRIC_BUCKETS ? b : METRIC_BUCKETS - 1;
+}
+//-L/-J: picks this node's id, opens the port other nodes link to and starts
+//the link thread; before any client joins a room, so no interest is missed
+void link_start()
+{
+	struct sockaddr_in addr = { AF_INET, htons(config.link_port) };
+	struct epoll_event ev;
+	struct timespec ts;
+	int on = 1, i;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	link_node = ((uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec) ^ ((uint64_t)getpid() << 40);
+	for (i = 0; i < LINK_MAX_PEERS; i++)
+		links[i].m_fd = -1;
+	mpsc_init(&link_box.m_queue);
+	if ((link_box.m_wake_fd = eventfd(0, EFD_NONBLOCK)) == -1 || (link_epfd = epoll_create1(0)) == -1)
+	{
+		perror("Server Error: Link setup failed");
+		exit(1);
+	}
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u64 = WAKE_HANDLE;
+	if (epoll_ctl(link_epfd, EPOLL_CTL_ADD, link_box.m_wake_fd, &ev) == -1)
+	{
+		perror("Server Error: epoll_ctl failed");
+		exit(1);
+	}
+	if (config.link_port != 0)
+	{
+		//SO_REUSEPORT lets a replacement server (-U) bind it while we still run
+		if ((link_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+			|| setsockopt(link_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+			|| setsockopt(link_listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1
+			|| bind(link_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+			|| listen(link_listen_fd, LINK_MAX_PEERS) == -1
+			|| set_nonblocking(link_listen_fd) == -1)
+		{
+			perror("Server Error: Link socket failed");
+			exit(1);
+		}
+		ev.data.u64 = LISTENER_HANDLE;
+		if (epoll_ctl(link_epfd, EPOLL_CTL_ADD, link_listen_fd, &ev) == -1)
+		{
+			perror("Server Error: epoll_ctl failed");
+			exit(1);
+		}
+	}
+	links_on = 1;
+	if (pthread_create(&link_thread, NULL, link_main, NULL) != 0)
+	{
+		perror("Error Creating Thread\n");
+		exit(1);
+	}
+}
+//after the reactors are gone, nothing posts to the link mailbox any more
+void link_stop()
+{
+	uint64_t one = 1;
+	atomic_store(&link_stopping, 1);
+	write(link_box.m_wake_fd, &one, sizeof(one));
+	pthread_join(link_thread, NULL);
+	if (link_listen_fd != -1)
+		close(link_listen_fd);
+}
+//the link thread: one epoll loop over the link port, the mailbox and every
+//link; what the reactors post during a pass is gathered per peer and goes
+//out in one write at the end of it
+void *link_main(void * arg)
+{
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t wakeups, now, next_dial = 0;
+	struct link *l;
+	int i, n;
+	while (!atomic_load(&link_stopping))
+	{
+		if ((now = now_ns()) >= next_dial)
+		{
+			link_dial_all();
+			next_dial = now + LINK_RETRY_MS * 1000000ull;
+		}
+		atomic_store(&link_box.m_armed, 1);
+		link_drain();
+		n = epoll_wait(link_epfd, events, MAX_EVENTS, (next_dial - now + 999999) / 1000000);
+		atomic_store_explicit(&link_box.m_armed, 0, memory_order_relaxed);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("Server Error: epoll_wait failed");
+			exit(1);
+		}
+		for (i = 0; i < n; i++)
+		{
+			if (events[i].data.u64 == LISTENER_HANDLE)
+				link_accept();
+			else if (events[i].data.u64 == WAKE_HANDLE)
+			{
+				read(link_box.m_wake_fd, &wakeups, sizeof(wakeups));
+				link_drain();
+			}
+			else
+			{
+				//tagged (generation << 32 | slot) like the sessions
+				l = &links[(uint32_t)events[i].data.u64];
+				if (l->m_fd == -1 || l->m_gen != events[i].data.u64 >> 32)
+					continue;
+				if (l->m_connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+					link_connected(l);
+				if (l->m_fd != -1 && !l->m_connecting && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+					link_read(l);
+			}
+		}
+		for (i = 0; i < LINK_MAX_PEERS; i++)
+		{
+			if (links[i].m_fd != -1 && links[i].m_broken)
+				link_close(&links[i]);
+			else if (links[i].m_fd != -1 && !links[i].m_connecting && links[i].m_out_len > 0)
+				link_flush(&links[i]);
+		}
+	}
+	//whatever the reactors posted last gets one try, stream ends from a
+	//handoff among it, then the peers see the links drop
+	link_drain();
+	for (i = 0; i < LINK_MAX_PEERS; i++)
+	{
+		if (links[i].m_fd != -1 && !links[i].m_broken && !links[i].m_connecting && links[i].m_ready)
+			link_flush(&links[i]);
+		if (links[i].m_fd != -1)
+			link_close(&links[i]);
+	}
+	return NULL;
+}
+//handles everything the reactors posted to the link thread
+void link_drain()
+{
+	mail *m;
+	while ((m = mpsc_pop(&link_box.m_queue)) != NULL)
+	{
+		if (m->m_kind == MAIL_FORWARD)
+		{
+			link_forward(m->m_room, m->m_msg);
+			message_release(m->m_msg);
+		}
+		else if (m->m_kind == MAIL_INTEREST)
+			link_announce(m->m_room);
+		pool_free(m);
+	}
+}
+//takes every node waiting on the link port
+void link_accept()
+{
+	int fd;
+	while ((fd = accept(link_listen_fd, NULL, NULL)) != -1)
+	{
+		if (set_nonblocking(fd) == -1 || link_open(fd, -1, 0) == NULL)
+		{
+			log_write(LOG_WARN, "Link Error: more than %d links, refusing another node", LINK_MAX_PEERS);
+			close(fd);
+		}
+	}
+}
+//dials every -J node that is not linked, one way or the other
+void link_dial_all()
+{
+	int dial, i, linked;
+	for (dial = 0; dial < config.link_dials; dial++)
+	{
+		//linked to ourselves once, no use trying again
+		if (link_dialed_node[dial] == link_node)
+			continue;
+		for (i = 0, linked = 0; i < LINK_MAX_PEERS && !linked; i++)
+		{
+			//our own dial still up, or the node dialed us instead
+			linked = links[i].m_fd != -1 && (links[i].m_dial == dial
+				|| (links[i].m_ready && link_dialed_node[dial] != 0 && links[i].m_node == link_dialed_node[dial]));
+		}
+		if (!linked)
+			link_dial(dial);
+	}
+}
+//starts a non-blocking connect() to config.link_to[dial]
+void link_dial(int dial)
+{
+	struct addrinfo hints = { 0 }, *res;
+	char host[256];
+	const char *port = strrchr(config.link_to[dial], ':');
+	int fd;
+	snprintf(host, sizeof(host), "%.*s", (int)(port - config.link_to[dial]), config.link_to[dial]);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port + 1, &hints, &res) != 0)
+	{
+		log_write(LOG_DEBUG, "Link Error: can not resolve %s", config.link_to[dial]);
+		return;
+	}
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+	{
+		freeaddrinfo(res);
+		return;
+	}
+	if (connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+		link_open(fd, dial, 0);
+	else if (errno != EINPROGRESS || link_open(fd, dial, 1) == NULL)
+	{
+		log_write(LOG_DEBUG, "Link Error: %s: %s", config.link_to[dial], strerror(errno));
+		close(fd);
+	}
+	freeaddrinfo(res);
+}
+//gives a connected (or connecting) socket a link slot and queues our hello
+//NULL if every slot is taken
+struct link *link_open(int fd, int dial, int connecting)
+{
+	struct epoll_event ev;
+	char hello[17];
+	struct link *l = NULL;
+	int i, on = 1;
+	for (i = 0; i < LINK_MAX_PEERS && l == NULL; i++)
+	{
+		if (links[i].m_fd == -1)
+			l = &links[i];
+	}
+	if (l == NULL)
+		return NULL;
+	if (frame_reader_init(&l->m_in) == -1)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	//we batch ourselves, Nagle would only add a round trip on top
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	l->m_fd = fd;
+	l->m_dial = dial;
+	l->m_connecting = connecting;
+	l->m_ready = 0;
+	l->m_broken = 0;
+	l->m_node = 0;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.u64 = (uint64_t)l->m_gen << 32 | (uint32_t)(l - links);
+	if (epoll_ctl(link_epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	{
+		perror("Server Error: epoll_ctl failed");
+		exit(1);
+	}
+	snprintf(hello, sizeof(hello), "%016llx", (unsigned long long)link_node);
+	link_queue(l, LINK_HELLO, hello, 16);
+	return l;
+}
+//frees the slot; the peer's rooms forget it, it has to say hello again
+void link_close(struct link * l)
+{
+	uint64_t bit = (uint64_t)1 << (l - links);
+	size_t i;
+	room *r;
+	if (l->m_ready)
+		log_write(LOG_INFO, ">>Lost the link to node %016llx", (unsigned long long)l->m_node);
+	close(l->m_fd);
+	frame_reader_free(&l->m_in);
+	free(l->m_out);
+	l->m_out = NULL;
+	l->m_out_len = l->m_out_cap = 0;
+	l->m_fd = -1;
+	l->m_ready = 0;
+	l->m_gen++;
+	pthread_mutex_lock(&room_lock);
+	for (i = 0; i < room_buckets; i++)
+	{
+		for (r = room_table[i]; r != NULL; r = r->m_next)
+			atomic_fetch_and(&r->m_peers, ~bit);
+	}
+	pthread_mutex_unlock(&room_lock);
+}
+//a dial finished, one way or the other
+void link_connected(struct link * l)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+	getsockopt(l->m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (err != 0)
+	{
+		log_write(LOG_DEBUG, "Link Error: %s: %s", config.link_to[l->m_dial], strerror(err));
+		link_close(l);
+		return;
+	}
+	l->m_connecting = 0;
+	//the hello may have sat in the buffer since the dial, and the peer's may be in
+	link_flush(l);
+	if (l->m_fd != -1)
+		link_read(l);
+}
+//reads everything the peer sent and handles it frame by frame
+void link_read(struct link * l)
+{
+	struct frame f;
+	unsigned char *space;
+	size_t space_len;
+	ssize_t n;
+	int got;
+	for (;;)
+	{
+		space = frame_reader_space(&l->m_in, &space_len);
+		if ((n = read(l->m_fd, space, space_len)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+		}
+		if (n <= 0)
+		{
+			link_close(l);
+			return;
+		}
+		frame_reader_commit(&l->m_in, n);
+		while ((got = frame_next(&l->m_in, &f)) == 1)
+		{
+			link_frame(l, &f);
+			if (l->m_fd == -1)
+				return;
+		}
+		if (got == -1)
+		{
+			log_write(LOG_WARN, "Link Error: malformed data from node %016llx", (unsigned long long)l->m_node);
+			link_close(l);
+			return;
+		}
+	}
+}
+//one frame from a peer
+void link_frame(struct link * l, struct frame * f)
+{
+	char name[ROOM_NAME_SIZE];
+	uint64_t bit = (uint64_t)1 << (l - links);
+	room *target;
+	if (!l->m_ready)
+	{
+		//nothing counts before the hello
+		if (f->type == LINK_HELLO)
+			link_hello(l, f);
+		else
+			link_close(l);
+		return;
+	}
+	switch (f->type)
+	{
+	case LINK_JOIN:
+	case LINK_PART:
+		if (f->length == 0 || f->length >= ROOM_NAME_SIZE)
+			break;
+		memcpy(name, f->payload, f->length);
+		name[f->length] = '\0';
+		//rooms are created here too, so our broadcasts find the peer's bit,
+		//but only so many: a peer must not be able to fill our memory
+		if ((target = room_find(name, 0)) == NULL && f->type == LINK_JOIN)
+		{
+			if (link_rooms == LINK_ROOMS_MAX)
+			{
+				log_write(LOG_WARN, "Link Error: node %016llx joined %s, but peers may create no more rooms",
+					(unsigned long long)l->m_node, name);
+				break;
+			}
+			target = room_find(name, 1);
+			link_rooms++;
+		}
+		if (target == NULL)
+			break;
+		if (f->type == LINK_JOIN)
+			atomic_fetch_or(&target->m_peers, bit);
+		else
+			atomic_fetch_and(&target->m_peers, ~bit);
+		break;
+	case LINK_ROOM:
+		link_deliver(f);
+		break;
+	default:
+		break; //a newer node, what we do not know we skip
+	}
+}
+//the peer introduced itself: drops links to ourselves and the second of two
+//links to the same node, then tells the peer where our members are
+void link_hello(struct link * l, struct frame * f)
+{
+	char hex[17];
+	uint64_t node, low, mine, theirs;
+	struct link *other = NULL;
+	size_t i;
+	room *r;
+	if (f->length != 16)
+	{
+		link_close(l);
+		return;
+	}
+	memcpy(hex, f->payload, 16);
+	hex[16] = '\0';
+	node = strtoull(hex, NULL, 16);
+	if (l->m_dial >= 0)
+		link_dialed_node[l->m_dial] = node;
+	if (node == link_node)
+	{
+		//both ends of the loop get here, only the dialing one names it
+		if (l->m_dial >= 0)
+			log_write(LOG_WARN, "Link Error: %s is this server", config.link_to[l->m_dial]);
+		link_close(l);
+		return;
+	}
+	for (i = 0; i < LINK_MAX_PEERS && other == NULL; i++)
+	{
+		if (links[i].m_fd != -1 && links[i].m_ready && links[i].m_node == node)
+			other = &links[i];
+	}
+	if (other != NULL)
+	{
+		//both ends dialed: each end keeps the link the lower node id dialed,
+		//so they agree without another round trip; otherwise the older one stays
+		low = link_node < node ? link_node : node;
+		mine = l->m_dial >= 0 ? link_node : node;
+		theirs = other->m_dial >= 0 ? link_node : node;
+		if (mine == theirs || theirs == low)
+		{
+			link_close(l);
+			return;
+		}
+		link_close(other);
+	}
+	l->m_node = node;
+	l->m_ready = 1;
+	log_write(LOG_INFO, ">>Linked with node %016llx", (unsigned long long)node);
+	pthread_mutex_lock(&room_lock);
+	for (i = 0; i < room_buckets; i++)
+	{
+		for (r = room_table[i]; r != NULL; r = r->m_next)
+		{
+			if (r->m_announced)
+				link_queue(l, LINK_JOIN, r->m_name, strlen(r->m_name));
+		}
+	}
+	pthread_mutex_unlock(&room_lock);
+}
+//a broadcast from a peer goes to the room's home reactor, which records
+//it and delivers it to our members
+void link_deliver(struct frame * f)
+{
+	const char *end = memchr(f->payload, '\0', f->length);
+	size_t name_len, len;
+	message *msg;
+	room *target;
+	if (f->length < 2 || end == NULL || (name_len = end - f->payload - 1) == 0 || name_len >= ROOM_NAME_SIZE)
+		return;
+	//the room may have emptied out here since we last told the peer
+	target = room_find(f->payload + 1, 0);
+	if (target == NULL || atomic_load(&target->m_members) == 0)
+		return;
+	len = f->length - name_len - 2;
+	msg = message_alloc(FRAME_HEADER_MAX + len);
+	msg->m_len = frame_encode(msg->m_data, FRAME_HEADER_MAX + len, (unsigned char)f->payload[0], end + 1, len);
+	post_to_reactor(ROOM_HOME(target), MAIL_REMOTE, target, 0, msg);
+	message_release(msg);
+	link_received++;
+}
+//one broadcast, queued once for every peer with members in its room
+void link_forward(room * target, message * msg)
+{
+	unsigned char buf[FRAME_MAX_PAYLOAD];
+	uint64_t peers = atomic_load(&target->m_peers);
+	size_t name_len = strlen(target->m_name), len;
+	int type, i;
+	message_payload(msg, &type, &len);
+	if (2 + name_len + len > sizeof(buf))
+	{
+		log_write(LOG_DEBUG, "Link Error: a %zu byte frame in %s is too big to forward", len, target->m_name);
+		return;
+	}
+	buf[0] = type;
+	memcpy(buf + 1, target->m_name, name_len + 1);
+	//a sliced line's payload is in pieces, the header is not
+	message_read(msg, msg->m_len - len, buf + 2 + name_len, len);
+	for (i = 0; i < LINK_MAX_PEERS; i++)
+	{
+		if ((peers & ((uint64_t)1 << i)) && links[i].m_fd != -1 && links[i].m_ready)
+		{
+			link_queue(&links[i], LINK_ROOM, buf, 2 + name_len + len);
+			link_forwarded++;
+		}
+	}
+}
+//a room gained its first or lost its last member here; the mails from two
+//reactors can arrive out of order, so the count decides, not the mail
+void link_announce(room * target)
+{
+	int have = atomic_load(&target->m_members) > 0, i;
+	if (have == target->m_announced)
+		return;
+	target->m_announced = have;
+	for (i = 0; i < LINK_MAX_PEERS; i++)
+	{
+		if (links[i].m_fd != -1 && links[i].m_ready)
+			link_queue(&links[i], have ? LINK_JOIN : LINK_PART, target->m_name, strlen(target->m_name));
+	}
+}
+//appends a frame to what goes to the peer at the end of this pass
+//a peer that stopped reading is dropped rather than buffered forever
+void link_queue(struct link * l, int type, const void * payload, size_t len)
+{
+	size_t need = l->m_out_len + FRAME_HEADER_MAX + len;
+	if (l->m_broken)
+		return;
+	if (need > l->m_out_cap)
+	{
+		//may be called with room_lock held, so the link is closed later
+		if (need > LINK_OUT_MAX)
+		{
+			log_write(LOG_WARN, "Link Error: node %016llx is not keeping up, dropping the link", (unsigned long long)l->m_node);
+			l->m_broken = 1;
+			return;
+		}
+		l->m_out_cap = l->m_out_cap ? l->m_out_cap * 2 : FRAME_READER_SIZE;
+		if (l->m_out_cap < need)
+			l->m_out_cap = need;
+		if ((l->m_out = realloc(l->m_out, l->m_out_cap)) == NULL)
+		{
+			perror("Server Error: Out of memory");
+			exit(1);
+		}
+	}
+	l->m_out_len += frame_encode(l->m_out + l->m_out_len, l->m_out_cap - l->m_out_len, type, payload, len);
+}
+//writes the gathered frames, the rest waits for the next EPOLLOUT edge
+void link_flush(struct link * l)
+{
+	ssize_t n;
+	while (l->m_out_len > 0)
+	{
+		if ((n = write(l->m_fd, l->m_out, l->m_out_len)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			link_close(l);
+			return;
+		}
+		link_writes++;
+		memmove(l->m_out, l->m_out + n, l->m_out_len - n);
+		l->m_out_len -= n;
+	}
+}
+//blocking write of all len bytes, 0 on success
+int write_full(int fd, const void * buf, size_t len)
+{
+	ssize_t n;
+	while (len > 0)
+	{
+		if ((n = write(fd, buf, len)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+//blocking read of exactly len bytes, -1 on error or end of stream
+int read_full(int fd, void * buf, size_t len)
+{
+	ssize_t n;
+	while (len > 0)
+	{
+		if ((n = read(fd, buf, len)) <= 0)
+		{
+			if (n == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+//This function tells the client's room that the client has left it
+void client_is_leaving(session * client_leaving)
+{
+	message *msg;
+	if (client_leaving->m_room == NULL)
+		return;
+	//a message broken off mid-stream ends before the notice, not after it
+	stream_end(client_leaving);
+	msg = message_printf(FRAME_NOTICE, ">>%s has left the ChatRoom %s.\n", client_leaving->m_name, client_leaving->m_room->m_name);
+	//tell everyone in the room that isn't the one currently leaving
+	broadcast_to_room(client_leaving->m_room, client_leaving, msg);
+	message_release(msg);
+}
+//This function tells the client's room that the client has entered it
+void client_has_entered(session * client_joining)
+{
+	message *msg;
+	msg = message_printf(FRAME_NOTICE, ">>%s has entered the ChatRoom %s.\n", client_joining->m_name, client_joining->m_room->m_name);
+	//tell everyone in the room that isn't the one currently entering
+	broadcast_to_room(client_joining->m_room, client_joining, msg);
+	message_release(msg);
+}
+//queues msg for every member of the room except one (usually the sender)
+//cost is the size of the room, not the number of connected clients;
+//members on other reactors are reached through their mailboxes
+void broadcast_to_room(room * target, session * except, message * msg)
+{
+	deliver_to_node(target, except, msg);
+	//a node with nobody in the room never hears about it either
+	if (atomic_load_explicit(&target->m_peers, memory_order_relaxed) != 0)
+		post_to_link(MAIL_FORWARD, target, msg);
+}
+//queues msg for every member of the room on this node
+void deliver_to_node(room * target, session * except, message * msg)
+{
+	int r;
+	deliver_local(target, except, msg);
+	for (r = 0; r < config.reactors; r++)
+	{
+		//a reactor with nobody in the room never hears about it
+		if (r != current->m_id && atomic_load_explicit(&target->m_local[r].m_count, memory_order_relaxed) > 0)
+			post_to_reactor(r, MAIL_BROADCAST, target, 0, msg);
+	}
+}
+//queues msg for this reactor's members of the room
+void deliver_local(room * target, session * except, message * msg)
+{
+	struct room_share *share = &target->m_local[current->m_id];
+	size_t i, count = atomic_load_explicit(&share->m_count, memory_order_relaxed);
+	for (i = 0; i < count; i++)
+	{
+		if (share->m_members[i] != except)
+		{
+			enqueue_message(share->m_members[i], msg);
+		}
+	}
+}
+//empty queue: head and tail both on the stub
+void mpsc_init(struct mpsc_queue * q)
+{
+	atomic_init(&q->m_stub.m_next, NULL);
+	atomic_init(&q->m_tail, &q->m_stub);
+	q->m_head = &q->m_stub;
+}
+//any thread: links m in behind the current tail, wait-free
+void mpsc_push(struct mpsc_queue * q, mail * m)
+{
+	mail *prev;
+	atomic_store_explicit(&m->m_next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&q->m_tail, m, memory_order_acq_rel);
+	//between the exchange and this store the chain is briefly broken,
+	//mpsc_pop() treats that as empty and the push's wakeup brings it back
+	atomic_store_explicit(&prev->m_next, m, memory_order_release);
+}
+//owner only: the oldest mail, or NULL if empty (or a push is half done)
+mail *mpsc_pop(struct mpsc_queue * q)
+{
+	mail *head = q->m_head;
+	mail *next = atomic_load_explicit(&head->m_next, memory_order_acquire);
+	if (head == &q->m_stub)
+	{
+		if (next == NULL)
+			return NULL;
+		q->m_head = next;
+		head = next;
+		next = atomic_load_explicit(&next->m_next, memory_order_acquire);
+	}
+	if (next != NULL)
+	{
+		q->m_head = next;
+		return head;
+	}
+	if (head != atomic_load_explicit(&q->m_tail, memory_order_acquire))
+		return NULL;
+	//head is the last real mail, put the stub behind it so it can be handed out
+	mpsc_push(q, &q->m_stub);
+	next = atomic_load_explicit(&head->m_next, memory_order_acquire);
+	if (next != NULL)
+	{
+		q->m_head = next;
+		return head;
+	}
+	return NULL;
+}
+//hands work to another reactor, never blocks and never takes a lock
+void post_to_reactor(int target, int kind, room * where, session_handle to, message * msg)
+{
+	mailbox_post(&reactors[target].m_mailbox, kind, where, to, msg, 0);
+}
+//hands work to the link thread, the same way
+void post_to_link(int kind, room * where, message * msg)
+{
+	mailbox_post(&link_box, kind, where, 0, msg, 0);
+}
+//queues a mail in box and wakes its owner if it may be asleep
+void mailbox_post(struct mailbox * box, int kind, room * where, session_handle to, message * msg, uint32_t credit)
+{
+	uint64_t one = 1;
+	mail *m;
+	//the receiver frees it, straight back onto our pool's remote list
+	m = pool_alloc(sizeof(mail));
+	m->m_kind = kind;
+	m->m_credit = credit;
+	m->m_room = where;
+	m->m_to = to;
+	m->m_msg = msg;
+	if (msg != NULL)
+		atomic_fetch_add_explicit(&msg->m_refs, 1, memory_order_relaxed);
+	m->m_posted = now_ns();
+	mpsc_push(&box->m_queue, m);
+	//only a reactor that may be asleep costs a syscall
+	if (atomic_exchange(&box->m_armed, 0) == 1)
+		write(box->m_wake_fd, &one, sizeof(one));
+}
+//handles everything the other reactors posted to us
+void drain_mailbox()
+{
+	struct mpsc_queue *q = &current->m_mailbox.m_queue;
+	uint64_t now;
+	session *client;
+	size_t len;
+	int type;
+	mail *m;
+	while ((m = mpsc_pop(q)) != NULL)
+	{
+		now = now_ns();
+		record_latency(&current->m_mail_latency, now > m->m_posted ? now - m->m_posted : 0);
+		if (m->m_kind == MAIL_BROADCAST)
+		{
+			deliver_local(m->m_room, NULL, m->m_msg);
+			message_release(m->m_msg);
+		}
+		else if (m->m_kind == MAIL_DIRECT)
+		{
+			//the recipient may have left or been renamed away since
+			if ((client = session_lookup(m->m_to)) != NULL && client->m_state == STATE_CHAT)
+				enqueue_message(client, m->m_msg);
+			message_release(m->m_msg);
+		}
+		else if (m->m_kind == MAIL_REMOTE)
+		{
+			//the link thread always picks the same reactor for a room, so lines
+			//from another node are recorded and delivered in the order they came
+			//later joiners see them like our own, but they never go back out
+			message_payload(m->m_msg, &type, &len);
+			if (type == FRAME_TEXT)
+				room_record(m->m_room, m->m_msg);
+			deliver_to_node(m->m_room, NULL, m->m_msg);
+			message_release(m->m_msg);
+		}
+		else if (m->m_kind == MAIL_RECORD)
+		{
+			room_record(m->m_room, m->m_msg);
+			message_release(m->m_msg);
+		}
+		else if (m->m_kind == MAIL_CREDIT)
+		{
+			if ((client = session_lookup(m->m_to)) != NULL)
+				credit_client(client, m->m_credit);
+		}
+		pool_free(m);
+	}
+}
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+void record_latency(struct latency_stats * stats, uint64_t ns)
+{
+	int b = ns ? 63 - __builtin_clzll(ns) : 0;
+	stats->m_count++;
+	stats->m_total += ns;
+	if (ns > stats->m_max)
+		stats->m_max = ns;
+	stats->m_buckets[b]++;
+}
+#ifdef CHAT_TRACE
+void trace_record(int stage, uint64_t since)
+{
+	uint64_t now;
+	if (since == 0)
+		return;
+	now = now_ns();
+	record_latency(&current->m_trace[stage], now > since ? now - since : 0);
+}
+//swaps the caller's reference to a stamped message for one to an unstamped
+//copy of its bytes, so a replay does not count as the line being sent
+message *message_untraced(message * msg)
+{
+	message *copy = message_alloc(msg->m_len);
+	message_read(msg, 0, copy->m_data, msg->m_len);
+	message_release(msg);
+	return copy;
+}
+#endif
+//upper edge of the bucket holding the pct-th percentile, in ns
+uint64_t latency_percentile(struct latency_stats * stats, double pct)
+{
+	unsigned long want = (unsigned long)(stats->m_count * pct / 100.0), seen = 0;
+	int b;
+	for (b = 0; b < LATENCY_BUCKETS - 1; b++)
+	{
+		seen += stats->m_buckets[b];
+		if (seen > want)
+			break;
+	}
+	return ((uint64_t)2 << b) < stats->m_max ? (uint64_t)2 << b : stats->m_max;
+}
+//FNV-1a, room names are short so this is plenty
+uint32_t room_hash(const char * name)
+{
+	uint32_t h = 2166136261u;
+	while (*name)
+	{
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+//looks a room up by name, optionally creating it
+//NULL if it does not exist and create is 0
+room *room_find(const char * name, int create)
+{
+	uint32_t h = room_hash(name);
+	room *r;
+	pthread_mutex_lock(&room_lock);
+	if (room_buckets > 0)
+	{
+		for (r = room_table[h & (room_buckets - 1)]; r != NULL; r = r->m_next)
+		{
+			if (r->m_hash == h && strcmp(r->m_name, name) == 0)
+			{
+				pthread_mutex_unlock(&room_lock);
+				return r;
+			}
+		}
+	}
+	if (!create)
+	{
+		pthread_mutex_unlock(&room_lock);
+		return NULL;
+	}
+	//keep the load factor at or below one
+	if (room_total >= room_buckets)
+		room_grow();
+	if ((r = calloc(1, sizeof(room))) == NULL
+		|| (r->m_local = aligned_alloc(CACHE_LINE, config.reactors * sizeof(struct room_share))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	memset(r->m_local, 0, config.reactors * sizeof(struct room_share));
+	pthread_mutex_init(&r->m_lock, NULL);
+	if (config.scrollback > 0 && (r->m_scroll = calloc(config.scrollback, sizeof(struct scroll_slot))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	if (config.history_dir != NULL)
+	{
+		if ((r->m_history = calloc(1, sizeof(struct history))) == NULL
+			|| (r->m_history->m_held = calloc(HISTORY_HELD, sizeof(message *))) == NULL
+			|| (config.history_replay > 0 && (r->m_history->m_recent = calloc(config.history_replay, sizeof(struct history_entry))) == NULL))
+		{
+			perror("Server Error: Out of memory");
+			exit(1);
+		}
+		r->m_history->m_room = r;
+	}
+	strncpy(r->m_name, name, ROOM_NAME_SIZE - 1);
+	r->m_hash = h;
+	r->m_next = room_table[h & (room_buckets - 1)];
+	room_table[h & (room_buckets - 1)] = r;
+	room_total++;
+	//the history thread opens the log, the room is usable right away
+	if (r->m_history != NULL)
+		history_add(r->m_history);
+	pthread_mutex_unlock(&room_lock);
+	return r;
+}
+//doubles the bucket array and rehashes every room into it
+//called with room_lock held
+void room_grow()
+{
+	size_t buckets = room_buckets ? room_buckets * 2 : ROOM_BUCKETS;
+	room **table, *r, *next;
+	size_t i;
+	if ((table = calloc(buckets, sizeof(room *))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	for (i = 0; i < room_buckets; i++)
+	{
+		for (r = room_table[i]; r != NULL; r = next)
+		{
+			next = r->m_next;
+			r->m_next = table[r->m_hash & (buckets - 1)];
+			table[r->m_hash & (buckets - 1)] = r;
+		}
+	}
+	free(room_table);
+	room_table = table;
+	room_buckets = buckets;
+}
+//adds the client to the end of its reactor's share of the room
+void room_join(session * client, room * target)
+{
+	struct room_share *share = &target->m_local[current->m_id];
+	size_t count = atomic_load_explicit(&share->m_count, memory_order_relaxed);
+	session **grown;
+	if (count == share->m_cap)
+	{
+		share->m_cap = share->m_cap ? share->m_cap * 2 : 8;
+		if ((grown = realloc(share->m_members, share->m_cap * sizeof(session *))) == NULL)
+		{
+			perror("Server Error: Out of memory");
+			exit(1);
+		}
+		share->m_members = grown;
+	}
+	client->m_room = target;
+	client->m_room_slot = count;
+	share->m_members[count] = client;
+	atomic_store_explicit(&share->m_count, count + 1, memory_order_relaxed);
+	//the first member on this node, the other nodes will want our broadcasts
+	if (links_on && atomic_fetch_add(&target->m_members, 1) == 0)
+		post_to_link(MAIL_INTEREST, target, NULL);
+}
+//removes the client from its room, the last member fills the hole
+void room_leave(session * client)
+{
+	struct room_share *share;
+	session *last;
+	size_t count;
+	if (client->m_room == NULL)
+		return;
+	stream_end(client);
+	share = &client->m_room->m_local[current->m_id];
+	count = atomic_load_explicit(&share->m_count, memory_order_relaxed) - 1;
+	last = share->m_members[count];
+	share->m_members[client->m_room_slot] = last;
+	last->m_room_slot = client->m_room_slot;
+	atomic_store_explicit(&share->m_count, count, memory_order_relaxed);
+	if (links_on && atomic_fetch_sub(&client->m_room->m_members, 1) == 1)
+		post_to_link(MAIL_INTEREST, client->m_room, NULL);
+	client->m_room = NULL;
+}
+//moves the client to the named room, announcing it on both sides
+void change_room(session * client, const char * name)
+{
+	char notice[FRAME_MAX_PAYLOAD];
+	room *target;
+	//room names are one word
+	if (name[0] == '\0' || strlen(name) >= ROOM_NAME_SIZE || strchr(name, ' ') != NULL)
+	{
+		snprintf(notice, sizeof(notice), ">>Room names are 1 to %d characters without spaces.\n", ROOM_NAME_SIZE - 1);
+		queue_to_client(client, FRAME_NOTICE, notice);
+		return;
+	}
+	target = room_find(name, 1);
+	if (target == client->m_room)
+		return;
+	client_is_leaving(client);
+	room_leave(client);
+	room_join(client, target);
+	snprintf(notice, sizeof(notice), ">>You are now in %s.\n", target->m_name);
+	queue_to_client(client, FRAME_NOTICE, notice);
+	//catch up on what was said before
+	room_replay(client, target, config.history_replay);
+	client_has_entered(client);
+}
+//remembers a chat line for whoever joins the room later: in the
+//scrollback and, with -H, in the room's log on disk
+//only the room's home reactor writes them, the others mail it the line;
+//so a line said just as someone joins on a third reactor may miss them or
+//reach them twice, where a lock on every broadcast could rule that out
+void room_record(room * target, message * msg)
+{
+	unsigned long lines;
+	if (target->m_scroll == NULL && target->m_history == NULL)
+		return;
+	if (current->m_id != ROOM_HOME(target))
+	{
+		post_to_reactor(ROOM_HOME(target), MAIL_RECORD, target, 0, msg);
+		return;
+	}
+	lines = atomic_load_explicit(&target->m_lines, memory_order_relaxed);
+	if (target->m_scroll != NULL)
+		scrollback_add(target, msg, lines);
+	if (target->m_history != NULL)
+	{
+		pthread_mutex_lock(&target->m_lock);
+		history_append(target->m_history, msg);
+		pthread_mutex_unlock(&target->m_lock);
+	}
+	//publishes the slot to the replays
+	atomic_store_explicit(&target->m_lines, lines + 1, memory_order_release);
+}
+//puts line number seq in the room's scrollback ring, the oldest one makes way
+//the ring shares the broadcast message itself, it only takes a reference
+//home reactor only; a replay on another reactor may be taking a reference
+//to the frame being replaced, so the writer never waits for it: a frame
+//replaced under a pinned slot is left for the last reader out to release
+void scrollback_add(room * target, message * msg, unsigned long seq)
+{
+	struct scroll_slot *slot = &target->m_scroll[seq % config.scrollback];
+	struct scroll_retired *dead;
+	message *old;
+	atomic_fetch_add_explicit(&msg->m_refs, 1, memory_order_relaxed);
+	//a replay that may have seen msg in the slot also sees this
+	atomic_store(&target->m_writing, seq + 1);
+	old = atomic_exchange(&slot->m_msg, msg);
+	current->m_scroll.m_frames++;
+	current->m_scroll.m_bytes += sizeof(message) + msg->m_len;
+	if (old == NULL)
+		return;
+	//a reader that saw old pinned the slot first, anyone pinning now sees msg
+	if (atomic_load(&slot->m_readers) == 0)
+	{
+		current->m_scroll.m_frames--;
+		current->m_scroll.m_bytes -= sizeof(message) + old->m_len;
+		message_release(old);
+		return;
+	}
+	dead = pool_alloc(sizeof(struct scroll_retired));
+	dead->m_msg = old;
+	dead->m_next = atomic_load(&slot->m_retired);
+	while (!atomic_compare_exchange_weak(&slot->m_retired, &dead->m_next, dead))
+		;
+	//the readers may all have left before it was there for them to see
+	if (atomic_load(&slot->m_readers) == 0)
+		scrollback_reap(slot);
+}
+//releases the frames replaced under a slot's readers, called by whoever
+//saw the slot unpinned after they were put there; any reactor
+void scrollback_reap(struct scroll_slot * slot)
+{
+	struct scroll_retired *dead = atomic_exchange(&slot->m_retired, NULL), *next;
+	for (; dead != NULL; dead = next)
+	{
+		next = dead->m_next;
+		//the stats are per reactor, only their sum is what is held
+		current->m_scroll.m_frames--;
+		current->m_scroll.m_bytes -= sizeof(message) + dead->m_msg->m_len;
+		message_release(dead->m_msg);
+		pool_free(dead);
+	}
+}
+//sends the client the room's last want lines, config.history_replay on a
+//join and up to that for /history
+//the scrollback serves it when it holds that many (or everything the room
+//has had); otherwise it is a miss and the log on disk is used if there is one
+//the scrollback is read without a lock: each slot is pinned while its
+//frame gets a reference, and frames the home reactor replaced in the
+//meantime are left out, so a busy room may replay a few lines less
+void room_replay(session * client, room * target, size_t want)
+{
+	struct scroll_slot *slot;
+	unsigned long lines, now;
+	size_t count = 0, held, first = 0, i;
+	message **batch;
+	int hit;
+	if (want == 0 || (target->m_scroll == NULL && target->m_history == NULL))
+		return;
+	batch = pool_alloc(want * sizeof(message *));
+	lines = atomic_load_explicit(&target->m_lines, memory_order_acquire);
+	held = lines < config.scrollback ? lines : config.scrollback;
+	hit = target->m_scroll != NULL && (held >= want || (held == lines && target->m_history == NULL));
+	if (hit || target->m_history == NULL)
+	{
+		//the newest want frames, oldest first, each queue takes its own reference
+		count = held < want ? held : want;
+		for (i = 0; i < count; i++)
+		{
+			slot = &target->m_scroll[(lines - count + i) % config.scrollback];
+			atomic_fetch_add(&slot->m_readers, 1);
+			batch[i] = atomic_load(&slot->m_msg);
+			atomic_fetch_add_explicit(&batch[i]->m_refs, 1, memory_order_relaxed);
+			//the last one out lets go of what the writer replaced meanwhile
+			if (atomic_fetch_sub(&slot->m_readers, 1) == 1 && atomic_load(&slot->m_retired) != NULL)
+				scrollback_reap(slot);
+		}
+		//line lines - count + i was still in its slot unless the line
+		//config.scrollback after it had started to take its place
+		now = atomic_load(&target->m_writing);
+		while (first < count && lines - count + first + config.scrollback < now)
+			message_release(batch[first++]);
+	}
+	else
+	{
+		pthread_mutex_lock(&target->m_lock);
+		count = history_collect(target->m_history, batch, want, &held);
+		pthread_mutex_unlock(&target->m_lock);
+	}
+	if (target->m_scroll != NULL && lines > 0)
+	{
+		if (hit)
+			current->m_scroll.m_hits++;
+		else
+			current->m_scroll.m_misses++;
+	}
+	//enqueueing may already write to the socket
+	for (i = first; i < count; i++)
+	{
+#ifdef CHAT_TRACE
+		//a replayed line is not the live one, its stamps must not be measured again
+		if (batch[i]->m_t_room != 0)
+			batch[i] = message_untraced(batch[i]);
+#endif
+		enqueue_message(client, batch[i]);
+		message_release(batch[i]);
+	}
+	pool_free(batch);
+}
+//creates the history directory, opens the log of every room found in it
+//(before anyone can join one, so the first join gets its replay) and
+//starts the thread that looks after the logs from then on
+void history_start()
+{
+	char name[ROOM_NAME_SIZE];
+	struct history *h;
+	struct dirent *e;
+	DIR *dir;
+	if (mkdir(config.history_dir, 0755) == -1 && errno != EEXIST)
+	{
+		perror("Server Error: History directory");
+		exit(1);
+	}
+	if ((history_wake_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+	{
+		perror("Server Error: History eventfd");
+		exit(1);
+	}
+	if ((dir = opendir(config.history_dir)) != NULL)
+	{
+		while ((e = readdir(dir)) != NULL)
+		{
+			if (e->d_name[0] != '.' && history_room_name(name, e->d_name) == 0)
+				room_find(name, 1);
+		}
+		closedir(dir);
+	}
+	for (h = atomic_load(&history_list); h != NULL; h = h->m_next_log)
+		history_prepare(h);
+	if (pthread_create(&history_thread, NULL, history_main, NULL) != 0)
+	{
+		perror("Error Creating Thread\n");
+		exit(1);
+	}
+}
+//writes out what the reactors held back, syncs every log one last time
+//and trims the open segments to their contents
+void history_stop()
+{
+	char path[HISTORY_PATH];
+	struct history *h;
+	atomic_store(&history_stopping, 1);
+	pthread_join(history_thread, NULL);
+	for (h = atomic_load(&history_list); h != NULL; h = h->m_next_log)
+	{
+		history_prepare(h);
+		history_sync(h);
+		pthread_mutex_lock(&h->m_room->m_lock);
+		if (h->m_full != NULL)
+		{
+			segment_trim(h, h->m_full);
+			segment_release(h->m_full);
+			h->m_full = NULL;
+		}
+		if (h->m_current != NULL && ftruncate(h->m_current->m_fd, h->m_current->m_used) == -1)
+			log_write(LOG_ERROR, "Server Error: Trimming the history of %s: %s", h->m_room->m_name, strerror(errno));
+		//the spare was never written to, the next start need not see it
+		if (h->m_spare != NULL)
+		{
+			history_path(path, h->m_room, h->m_spare->m_seq);
+			unlink(path);
+			segment_release(h->m_spare);
+			h->m_spare = NULL;
+		}
+		pthread_mutex_unlock(&h->m_room->m_lock);
+	}
+}
+//the history thread: prepares the logs whenever a reactor asks (a new
+//room, a segment filling up) and every HISTORY_SYNC_MS writes what was
+//appended to disk, so appending never waits on the disk
+void *history_main(void * arg)
+{
+	struct pollfd pfd = { history_wake_fd, POLLIN, 0 };
+	uint64_t synced = now_ns(), wakeups;
+	struct history *h;
+	while (!atomic_load(&history_stopping))
+	{
+		if (poll(&pfd, 1, 100) == 1 && read(history_wake_fd, &wakeups, sizeof(wakeups)) == sizeof(wakeups))
+		{
+			for (h = atomic_load(&history_list); h != NULL; h = h->m_next_log)
+				history_prepare(h);
+		}
+		if (now_ns() - synced >= HISTORY_SYNC_MS * 1000000ull)
+		{
+			for (h = atomic_load(&history_list); h != NULL; h = h->m_next_log)
+				history_sync(h);
+			synced = now_ns();
+		}
+	}
+	return NULL;
+}
+//hands a new room's log to the history thread, which opens it
+void history_add(struct history * h)
+{
+	struct history *head = atomic_load(&history_list);
+	do
+		h->m_next_log = head;
+	while (!atomic_compare_exchange_weak(&history_list, &head, h));
+	history_wake();
+}
+//asks the history thread to look at the logs, never blocks
+void history_wake()
+{
+	uint64_t one = 1;
+	//before history_start() the logs are prepared by the main thread
+	if (history_wake_fd != -1)
+		write(history_wake_fd, &one, sizeof(one));
+}
+//the history thread's share of a log, the disk work is done outside the
+//lock: opens the log, trims the segment the writer left full and opens a
+//spare; then copies in what the writer had to hold back meanwhile
+void history_prepare(struct history * h)
+{
+	segment *full, *spare = NULL;
+	uint32_t seq = 0;
+	int opened;
+	pthread_mutex_lock(&h->m_room->m_lock);
+	opened = h->m_opened;
+	full = h->m_full;
+	h->m_full = NULL;
+	if (opened && !h->m_failed && h->m_spare == NULL)
+		seq = h->m_current->m_seq + 1;
+	pthread_mutex_unlock(&h->m_room->m_lock);
+	if (full != NULL)
+	{
+		segment_trim(h, full);
+		segment_release(full);
+	}
+	//nobody looks at an unopened log but this thread
+	if (!opened && history_open(h) == 0)
+		seq = h->m_current->m_seq + 1;
+	if (seq != 0)
+		spare = segment_open(h, seq, 1);
+	pthread_mutex_lock(&h->m_room->m_lock);
+	h->m_opened = 1;
+	if (seq != 0 && spare == NULL)
+		history_failed(h, "opening its next segment");
+	else if (spare != NULL)
+		h->m_spare = spare;
+	history_catch_up(h);
+	pthread_mutex_unlock(&h->m_room->m_lock);
+}
+//msync()s the part of the current segment written so far, outside the lock
+void history_sync(struct history * h)
+{
+	segment *seg;
+	size_t used;
+	pthread_mutex_lock(&h->m_room->m_lock);
+	if (!h->m_dirty || h->m_current == NULL)
+	{
+		pthread_mutex_unlock(&h->m_room->m_lock);
+		return;
+	}
+	seg = h->m_current;
+	atomic_fetch_add(&seg->m_refs, 1);
+	used = seg->m_used;
+	h->m_dirty = 0;
+	pthread_mutex_unlock(&h->m_room->m_lock);
+	if (msync(seg->m_map, used, MS_SYNC) == -1)
+		log_write(LOG_ERROR, "Server Error: Syncing the history of %s: %s", h->m_room->m_name, strerror(errno));
+	history_syncs++;
+	segment_release(seg);
+}
+//finds the room's newest segment on disk and picks up where it ended
+//the one before it is read as well so the replay index is full again
+//runs on the history thread (or the main thread before the reactors
+//start) while the log is not open yet, so nobody else looks at it
+int history_open(struct history * h)
+{
+	char path[HISTORY_PATH], *end;
+	struct dirent *e;
+	segment *old;
+	uint32_t seq, newest = 0;
+	DIR *dir;
+	history_path(path, h->m_room, 0);
+	*strrchr(path, '/') = '\0';
+	if (mkdir(path, 0755) == -1 && errno != EEXIST)
+		return history_failed(h, "creating its directory");
+	if ((dir = opendir(path)) == NULL)
+		return history_failed(h, "reading its directory");
+	while ((e = readdir(dir)) != NULL)
+	{
+		seq = strtoul(e->d_name, &end, 10);
+		if (end != e->d_name && strcmp(end, ".seg") == 0 && seq > newest)
+			newest = seq;
+	}
+	closedir(dir);
+	if (newest > 0 && config.history_replay > 0 && (old = segment_open(h, newest - 1, 0)) != NULL)
+	{
+		history_scan(h, old);
+		segment_release(old);
+	}
+	if ((h->m_current = segment_open(h, newest, 1)) == NULL)
+		return history_failed(h, "opening its log");
+	history_scan(h, h->m_current);
+	return 0;
+}
+//turns history off for a room the disk let down, always -1
+int history_failed(struct history * h, const char * what)
+{
+	log_write(LOG_ERROR, "Server Error: History for %s disabled, %s: %s", h->m_room->m_name, what, strerror(errno));
+	h->m_failed = 1;
+	return -1;
+}
+//the room a directory in the history dir belongs to, undoing the escapes
+//of history_path(); -1 if it cannot be a room's
+int history_room_name(char * out, const char * dir)
+{
+	char hex[3] = { 0, 0, 0 };
+	size_t n = 0;
+	for (; *dir != '\0'; dir++)
+	{
+		if (n == ROOM_NAME_SIZE - 1)
+			return -1;
+		if (*dir != '%')
+			out[n++] = *dir;
+		else if (isxdigit((unsigned char)dir[1]) && isxdigit((unsigned char)dir[2]))
+		{
+			hex[0] = dir[1];
+			hex[1] = dir[2];
+			out[n++] = (char)strtoul(hex, NULL, 16);
+			dir += 2;
+		}
+		else
+			return -1;
+	}
+	out[n] = '\0';
+	//room names are one word, and a %00 would cut this one short
+	return n > 0 && strlen(out) == n && strchr(out, ' ') == NULL ? 0 : -1;
+}
+//opens and maps one segment file, NULL if that fails
+//the current segment is created if needed and always mapped at full size,
+//its unwritten tail reads as zeros
+segment *segment_open(struct history * h, uint32_t seq, int current)
+{
+	char path[HISTORY_PATH];
+	struct stat st;
+	segment *seg;
+	history_path(path, h->m_room, seq);
+	if ((seg = calloc(1, sizeof(segment))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	if ((seg->m_fd = open(path, O_RDWR | (current ? O_CREAT : 0), 0644)) == -1)
+	{
+		if (errno != ENOENT || current)
+			log_write(LOG_ERROR, "Server Error: History segment %s: %s", path, strerror(errno));
+		free(seg);
+		return NULL;
+	}
+	if (fstat(seg->m_fd, &st) == -1)
+		st.st_size = 0;
+	else if (current && st.st_size < HISTORY_SEGMENT)
+		st.st_size = ftruncate(seg->m_fd, HISTORY_SEGMENT) == -1 ? 0 : HISTORY_SEGMENT;
+	seg->m_size = st.st_size;
+	if (st.st_size == 0 || (seg->m_map = mmap(NULL, seg->m_size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->m_fd, 0)) == MAP_FAILED)
+	{
+		if (current)
+			log_write(LOG_ERROR, "Server Error: History segment %s: %s", path, strerror(errno));
+		close(seg->m_fd);
+		free(seg);
+		return NULL;
+	}
+	atomic_init(&seg->m_refs, 1);
+	seg->m_seq = seq;
+	return seg;
+}
+//the last reference unmaps and closes the file
+void segment_release(segment * seg)
+{
+	if (atomic_fetch_sub_explicit(&seg->m_refs, 1, memory_order_acq_rel) == 1)
+	{
+		munmap(seg->m_map, seg->m_size);
+		close(seg->m_fd);
+		free(seg);
+	}
+}
+//cuts a segment nothing more goes into down to its frames and starts
+//writing it out, on the history thread
+void segment_trim(struct history * h, segment * seg)
+{
+	msync(seg->m_map, seg->m_used, MS_ASYNC);
+	if (ftruncate(seg->m_fd, seg->m_used) == -1)
+		log_write(LOG_ERROR, "Server Error: Trimming the history of %s: %s", h->m_room->m_name, strerror(errno));
+}
+//walks the frames of a segment read back from disk, remembering the last
+//ones for replay; the first thing that is not a chat frame (the zeros of
+//the unwritten tail, or a frame cut short by a crash) is the end
+void history_scan(struct history * h, segment * seg)
+{
+	struct frame_reader r = { seg->m_map, 0, seg->m_size, seg->m_size };
+	struct frame f;
+	size_t start = 0;
+	while (frame_next(&r, &f) == 1 && f.type == FRAME_TEXT)
+	{
+		//frame_next() rewinds to 0 once everything is consumed
+		size_t end = r.m_start != 0 ? r.m_start : seg->m_size;
+		history_remember(h, seg, start, end - start);
+		start = end;
+	}
+	seg->m_used = start;
+}
+//adds a frame to the replay ring, pushing out the oldest
+void history_remember(struct history * h, segment * seg, size_t offset, size_t len)
+{
+	struct history_entry *e;
+	if (config.history_replay == 0)
+		return;
+	e = &h->m_recent[h->m_recent_next];
+	if (e->m_segment != NULL)
+		segment_release(e->m_segment);
+	atomic_fetch_add(&seg->m_refs, 1);
+	e->m_segment = seg;
+	e->m_offset = offset;
+	e->m_len = len;
+	h->m_recent_next = (h->m_recent_next + 1) % config.history_replay;
+	if (h->m_recent_count < config.history_replay)
+		h->m_recent_count++;
+}
+//logs a chat frame: copied into the mapped segment right away, or held
+//until the history thread has one ready (the log is still being opened,
+//or the current segment filled up before its spare was there)
+//called with the room's lock held
+void history_append(struct history * h, message * msg)
+{
+	if (h->m_opened && h->m_failed)
+		return;
+	//held frames go first, the log keeps the order they were said in
+	if (h->m_held_count > 0 || !h->m_opened || history_write(h, msg) == -1)
+	{
+		if (h->m_held_count == HISTORY_HELD)
+		{
+			current->m_history.m_lost++;
+			return;
+		}
+		atomic_fetch_add_explicit(&msg->m_refs, 1, memory_order_relaxed);
+		h->m_held[h->m_held_count++] = msg;
+	}
+	current->m_history.m_appended++;
+	current->m_history.m_bytes += msg->m_len;
+}
+//copies a frame to the end of the current segment, moving on to the spare
+//when it is full; -1 if there is no spare yet (the history thread is asked
+//for one), nothing here ever waits on the disk
+//called with the room's lock held
+int history_write(struct history * h, message * msg)
+{
+	segment *seg = h->m_current;
+	if (seg->m_used + msg->m_len > seg->m_size)
+	{
+		if (h->m_spare == NULL)
+		{
+			history_wake();
+			return -1;
+		}
+		//the history thread trims the full one, replays may still send from it
+		h->m_full = seg;
+		h->m_current = seg = h->m_spare;
+		h->m_spare = NULL;
+		history_wake();
+	}
+	message_read(msg, 0, seg->m_map + seg->m_used, msg->m_len);
+	history_remember(h, seg, seg->m_used, msg->m_len);
+	seg->m_used += msg->m_len;
+	h->m_dirty = 1;
+	return 0;
+}
+//copies the frames the writer held back into the log, oldest first, as
+//far as there is room; a log that failed just lets them go
+//called with the room's lock held
+void history_catch_up(struct history * h)
+{
+	size_t done = 0;
+	while (done < h->m_held_count)
+	{
+		if (!h->m_failed && (!h->m_opened || history_write(h, h->m_held[done]) == -1))
+			break;
+		message_release(h->m_held[done++]);
+	}
+	memmove(h->m_held, h->m_held + done, (h->m_held_count - done) * sizeof(message *));
+	h->m_held_count -= done;
+}
+//fills batch with the room's last logged lines, returns how many messages
+//that took and sets *lines to the number of lines in them
+//nothing is copied: each run of lines that sit next to each other in a
+//segment becomes one message that flush_client() sends with sendfile()
+//called with the room's lock held, batch has room for want (at most config.history_replay)
+size_t history_collect(struct history * h, message ** batch, size_t want, size_t * lines)
+{
+	struct history_entry *e;
+	message *msg = NULL;
+	size_t i, count = 0, first;
+	*lines = 0;
+	if (!h->m_opened || h->m_recent_count == 0)
+		return 0;
+	*lines = h->m_recent_count < want ? h->m_recent_count : want;
+	first = (h->m_recent_next + config.history_replay - *lines) % config.history_replay;
+	for (i = 0; i < *lines; i++)
+	{
+		e = &h->m_recent[(first + i) % config.history_replay];
+		if (msg != NULL && msg->m_segment == e->m_segment && (size_t)msg->m_offset + msg->m_len == e->m_offset)
+		{
+			msg->m_len += e->m_len;
+			continue;
+		}
+		msg = message_alloc(0);
+		atomic_fetch_add(&e->m_segment->m_refs, 1);
+		msg->m_segment = e->m_segment;
+		msg->m_offset = e->m_offset;
+		msg->m_len = e->m_len;
+		batch[count++] = msg;
+	}
+	current->m_history.m_replays++;
+	current->m_history.m_replayed += *lines;
+	return count;
+}
+//<history dir>/<room>/<seq>.seg, anything but letters, digits, '-' and '_'
+//in the room name is escaped as %xx so it stays a single path component
+void history_path(char * out, room * target, uint32_t seq)
+{
+	size_t n = snprintf(out, HISTORY_PATH, "%s/", config.history_dir);
+	const char *c;
+	for (c = target->m_name; *c != '\0'; c++)
+	{
+		if (isalnum((unsigned char)*c) || *c == '-' || *c == '_')
+			out[n++] = *c;
+		else
+			n += snprintf(out + n, HISTORY_PATH - n, "%%%02x", (unsigned char)*c);
+	}
+	snprintf(out + n, HISTORY_PATH - n, "/%010u.seg", seq);
+}
+//appends one record to the calling thread's log ring, never blocks
+//records above config.log_level cost a single compare
+void log_write(int level, const char * format, ...)
+{
+	struct log_ring *ring = log_local;
+	struct log_header *h;
+	struct timespec ts;
+	size_t head, tail, at, skip, need = sizeof(struct log_header) + LOG_TEXT_MAX;
+	va_list args;
+	int n;
+	if (level > config.log_level)
+		return;
+	if (ring == NULL && (ring = log_attach()) == NULL)
+		return;
+	tail = atomic_load_explicit(&ring->m_tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->m_head, memory_order_acquire);
+	at = tail % LOG_RING;
+	//a record never wraps around, the rest of the ring is skipped instead
+	skip = at + need > LOG_RING ? LOG_RING - at : 0;
+	if (LOG_RING - (tail - head) < skip + need)
+	{
+		//the flusher is behind, losing a line beats stalling a reactor
+		atomic_fetch_add_explicit(&ring->m_dropped, 1, memory_order_relaxed);
+		return;
+	}
+	if (skip > 0)
+	{
+		((struct log_header *)(ring->m_buf + at))->m_len = LOG_PAD;
+		tail += skip;
+		at = 0;
+	}
+	h = (struct log_header *)(ring->m_buf + at);
+	va_start(args, format);
+	n = vsnprintf((char *)(h + 1), LOG_TEXT_MAX, format, args);
+	va_end(args);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h->m_len = n < 0 ? 0 : (n >= LOG_TEXT_MAX ? LOG_TEXT_MAX - 1 : (uint32_t)n);
+	h->m_level = level;
+	h->m_source = ring->m_source;
+	h->m_pad = 0;
+	h->m_time = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+	atomic_store_explicit(&ring->m_tail, tail + LOG_ALIGN(sizeof(struct log_header) + h->m_len), memory_order_release);
+}
+//gives the calling thread a ring of its own, NULL if LOG_MAX_RINGS are taken
+struct log_ring *log_attach()
+{
+	struct log_ring *ring;
+	int slot;
+	if ((ring = calloc(1, sizeof(struct log_ring))) == NULL || (ring->m_buf = malloc(LOG_RING)) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		exit(1);
+	}
+	ring->m_source = current != NULL ? current->m_id : LOG_SOURCE_OTHER;
+	if ((slot = atomic_fetch_add(&log_ring_count, 1)) >= LOG_MAX_RINGS)
+	{
+		free(ring->m_buf);
+		free(ring);
+		return NULL;
+	}
+	atomic_store_explicit(&log_rings[slot], ring, memory_order_release);
+	log_local = ring;
+	return ring;
+}
+void log_start()
+{
+	if (pthread_create(&log_thread, NULL, log_main, NULL) != 0)
+	{
+		perror("Error Creating Thread\n");
+		exit(1);
+	}
+}
+//flushes whatever is still in the rings and stops the flusher
+void log_stop()
+{
+	atomic_store(&log_stopping, 1);
+	pthread_join(log_thread, NULL);
+}
+//the flusher thread: empties the rings, naps when there was nothing to do
+void *log_main(void * arg)
+{
+	struct timespec nap = { 0, LOG_FLUSH_MS * 1000000L };
+	int stopping;
+	for (;;)
+	{
+		//anything logged before log_stop() is in the rings by the time it is seen
+		stopping = atomic_load(&log_stopping);
+		if (log_drain() == 0)
+		{
+			if (stopping)
+				break;
+			nanosleep(&nap, NULL);
+		}
+	}
+	return NULL;
+}
+//moves every record out of every ring into the batch, one write() per
+//LOG_BATCH bytes, returns how many records there were
+size_t log_drain()
+{
+	struct log_header warning = { 0, LOG_WARN, LOG_SOURCE_OTHER, 0, 0 };
+	struct log_ring *ring;
+	struct log_header *h;
+	struct timespec ts;
+	char text[64];
+	size_t head, tail, at, records = 0;
+	unsigned long dropped;
+	int i, count = atomic_load(&log_ring_count);
+	for (i = 0; i < count && i < LOG_MAX_RINGS; i++)
+	{
+		if ((ring = atomic_load_explicit(&log_rings[i], memory_order_acquire)) == NULL)
+			continue; //claimed but not published yet
+		head = atomic_load_explicit(&ring->m_head, memory_order_relaxed);
+		tail = atomic_load_explicit(&ring->m_tail, memory_order_acquire);
+		while (head != tail)
+		{
+			at = head % LOG_RING;
+			h = (struct log_header *)(ring->m_buf + at);
+			if (h->m_len == LOG_PAD)
+				head += LOG_RING - at;
+			else
+			{
+				log_emit(h, (const char *)(h + 1));
+				head += LOG_ALIGN(sizeof(struct log_header) + h->m_len);
+				records++;
+			}
+		}
+		atomic_store_explicit(&ring->m_head, head, memory_order_release);
+		if ((dropped = atomic_load_explicit(&ring->m_dropped, memory_order_relaxed)) != ring->m_reported)
+		{
+			warning.m_len = snprintf(text, sizeof(text), ">>Logger: %lu records dropped", dropped - ring->m_reported);
+			warning.m_source = ring->m_source;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			warning.m_time = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+			log_emit(&warning, text);
+			ring->m_reported = dropped;
+			records++;
+		}
+	}
+	log_flush_batch();
+	return records;
+}
+//formats one record into the batch, writing the batch out first if it is full
+void log_emit(struct log_header * h, const char * text)
+{
+	static const char *names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+	time_t sec = h->m_time / 1000000000u;
+	struct tm tm;
+	if (LOG_BATCH - log_batch_len < sizeof(struct log_header) + LOG_TEXT_MAX + 32)
+		log_flush_batch();
+	if (config.log_format == LOG_BINARY)
+	{
+		memcpy(log_batch + log_batch_len, h, sizeof(struct log_header));
+		memcpy(log_batch + log_batch_len + sizeof(struct log_header), text, h->m_len);
+		log_batch_len += sizeof(struct log_header) + h->m_len;
+		return;
+	}
+	localtime_r(&sec, &tm);
+	log_batch_len += snprintf((char *)log_batch + log_batch_len, LOG_BATCH - log_batch_len, "%02d:%02d:%02d.%06lu %-5s %.*s\n",
+		tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned long)(h->m_time % 1000000000u / 1000), names[h->m_level], (int)h->m_len, text);
+}
+//hands the batch to stdout in as few write()s as it takes
+void log_flush_batch()
+{
+	size_t done = 0;
+	ssize_t n;
+	while (done < log_batch_len)
+	{
+		if ((n = write(STDOUT_FILENO, log_batch + done, log_batch_len - done)) > 0)
+			done += n;
+		else if (n == -1 && errno == EINTR)
+			continue;
+		else
+			break; //nowhere to log to, drop the batch
+	}
+	log_batch_len = 0;
+}
+//prints how often the slow consumer policies fired, summed over the reactors,
+//how full the pools are and what the session layout saves
+void print_stats()
+{
+	struct slow_consumer_stats total = { 0, 0, 0 };
+	struct latency_stats mail = { 0 };
+	size_t carved[POOL_CLASSES] = { 0 }, in_use[POOL_CLASSES] = { 0 };
+	size_t slab_bytes = 0, held = 0, slots = 0, used = 0, legacy, i;
+	unsigned long heap = 0, frames_out = 0, frames_in = 0, writes = 0, syscalls = 0, streams = 0, stream_bytes = 0;
+	struct history_stats history = { 0, 0, 0, 0 };
+	struct scrollback_stats scroll = { 0, 0, 0, 0 };
+	struct shutdown_stats shutdown = { 0, 0, 0 };
+	pool_block *b;
+	int r, c;
+	//what a session cost before: name and line buffers inline, a full
+	//config.queue_depth ring and a receive buffer for every slot ever used
+	legacy = sizeof(session) - sizeof(char *) - NAME_INLINE + 2 * BUFFER_SIZE;
+	for (r = 0; r < config.reactors; r++)
+	{
+		for (c = 0; c < POOL_CLASSES; c++)
+		{
+			carved[c] += reactors[r].m_pool[c].m_carved;
+			in_use[c] += reactors[r].m_pool[c].m_in_use;
+			//returned by another reactor but not yet picked up
+			for (b = atomic_load(&reactors[r].m_pool[c].m_remote); b != NULL; b = b->m_next)
+				in_use[c]--;
+		}
+		slab_bytes += reactors[r].m_pool_bytes;
+		heap += reactors[r].m_pool_heap;
+		held += reactors[r].m_session_bytes;
+		history.m_appended += reactors[r].m_history.m_appended;
+		history.m_bytes += reactors[r].m_history.m_bytes;
+		history.m_replays += reactors[r].m_history.m_replays;
+		history.m_replayed += reactors[r].m_history.m_replayed;
+		history.m_lost += reactors[r].m_history.m_lost;
+		scroll.m_hits += reactors[r].m_scroll.m_hits;
+		scroll.m_misses += reactors[r].m_scroll.m_misses;
+		scroll.m_frames += reactors[r].m_scroll.m_frames;
+		scroll.m_bytes += reactors[r].m_scroll.m_bytes;
+		shutdown.m_flushed += reactors[r].m_shutdown.m_flushed;
+		shutdown.m_cut_clients += reactors[r].m_shutdown.m_cut_clients;
+		shutdown.m_cut_frames += reactors[r].m_shutdown.m_cut_frames;
+		slots += reactors[r].m_slot_count;
+		for (i = 0; i < reactors[r].m_slot_count; i++)
+		{
+			if (reactors[r].m_chunks[i / SLAB_CHUNK][i % SLAB_CHUNK].m_queue != NULL)
+				used++;
+		}
+		frames_out += reactors[r].m_metrics.m_msgs_out;
+		writes += reactors[r].m_metrics.m_writes;
+		frames_in += reactors[r].m_metrics.m_msgs_in;
+		syscalls += reactors[r].m_metrics.m_syscalls;
+		streams += reactors[r].m_metrics.m_streams;
+		stream_bytes += reactors[r].m_metrics.m_stream_bytes;
+		total.m_dropped += reactors[r].m_slow.m_dropped;
+		total.m_coalesced += reactors[r].m_slow.m_coalesced;
+		total.m_disconnected += reactors[r].m_slow.m_disconnected;
+		mail.m_count += reactors[r].m_mail_latency.m_count;
+		mail.m_total += reactors[r].m_mail_latency.m_total;
+		if (reactors[r].m_mail_latency.m_max > mail.m_max)
+			mail.m_max = reactors[r].m_mail_latency.m_max;
+		for (c = 0; c < LATENCY_BUCKETS; c++)
+			mail.m_buckets[c] += reactors[r].m_mail_latency.m_buckets[c];
+	}
+	printf(">>Shutdown: %.1f ms, %lu frames flushed, %lu clients cut off with %lu frames unsent\n",
+		(shutdown_finished - shutdown_started) / 1e6, shutdown.m_flushed, shutdown.m_cut_clients, shutdown.m_cut_frames);
+	if (frames_out > 0)
+		printf(">>Flush: %lu frames in %lu write calls, %.3f calls per frame\n", frames_out, writes, (double)writes / frames_out);
+	if (frames_in + frames_out > 0)
+	{
+		printf(">>I/O (%s): %lu syscalls for %lu frames in and out, %.3f per frame\n", config.backend == BACKEND_URING ? "io_uring" : "epoll",
+			syscalls, frames_in + frames_out, (double)syscalls / (frames_in + frames_out));
+	}
+	if (streams > 0)
+		printf(">>Streams: %lu messages sent in chunks, %.1f KiB passed on\n", streams, stream_bytes / 1024.0);
+	printf(">>Slow consumers: %lu frames dropped, %lu queues coalesced, %lu clients disconnected\n",
+		total.m_dropped, total.m_coalesced, total.m_disconnected);
+	if (mail.m_count > 0)
+	{
+		printf(">>Mailbox: %lu deliveries, avg %.1f us, p50 < %.1f us, p99 < %.1f us, max %.1f us\n",
+			mail.m_count, mail.m_total / 1000.0 / mail.m_count, latency_percentile(&mail, 50) / 1000.0,
+			latency_percentile(&mail, 99) / 1000.0, mail.m_max / 1000.0);
+	}
+#ifdef CHAT_TRACE
+	{
+		static const char *stage_names[TRACE_STAGES] = { "read->parse", "parse->room", "room->enqueue", "room->write", "read->write" };
+		struct latency_stats stage;
+		int t;
+		for (t = 0; t < TRACE_STAGES; t++)
+		{
+			memset(&stage, 0, sizeof(stage));
+			for (r = 0; r < config.reactors; r++)
+			{
+				stage.m_count += reactors[r].m_trace[t].m_count;
+				stage.m_total += reactors[r].m_trace[t].m_total;
+				if (reactors[r].m_trace[t].m_max > stage.m_max)
+					stage.m_max = reactors[r].m_trace[t].m_max;
+				for (c = 0; c < LATENCY_BUCKETS; c++)
+					stage.m_buckets[c] += reactors[r].m_trace[t].m_buckets[c];
+			}
+			if (stage.m_count > 0)
+			{
+				printf(">>Trace %-13s %lu, avg %.1f us, p50 < %.1f us, p99 < %.1f us, max %.1f us\n",
+					stage_names[t], stage.m_count, stage.m_total / 1000.0 / stage.m_count, latency_percentile(&stage, 50) / 1000.0,
+					latency_percentile(&stage, 99) / 1000.0, stage.m_max / 1000.0);
+			}
+		}
+	}
+#endif
+	printf(">>Pool: %zu KiB in slabs, %lu oversized allocations, blocks in use/carved:", slab_bytes / 1024, heap);
+	for (c = 0; c < POOL_CLASSES; c++)
+		printf(" %zuB %zu/%zu", (size_t)1 << (POOL_MIN_SHIFT + c), in_use[c], carved[c]);
+	printf("\n");
+	legacy = slots * legacy + used * (config.queue_depth * sizeof(message *) + FRAME_READER_SIZE);
+	printf(">>Sessions: %zu slots of %zu bytes + %zu bytes of queues, buffers and names = %zu KiB (old layout %zu KiB, %zu KiB saved)\n",
+		slots, sizeof(session), held, (slots * sizeof(session) + held) / 1024, legacy / 1024,
+		(legacy - slots * sizeof(session) - held) / 1024);
+	if (handoff_sessions > 0)
+	{
+		printf(">>Handoff: %zu clients passed on with %lu KiB of unsent output\n",
+			handoff_sessions, (unsigned long)(handoff_bytes / 1024));
+	}
+	if (config.scrollback > 0)
+	{
+		printf(">>Scrollback: %lu hits, %lu misses, %ld frames held in %ld KiB\n",
+			scroll.m_hits, scroll.m_misses, scroll.m_frames, scroll.m_bytes / 1024);
+	}
+	if (links_on)
+	{
+		printf(">>Links: %lu frames forwarded in %lu writes, %lu frames received\n",
+			link_forwarded, link_writes, link_received);
+	}
+	if (config.history_dir != NULL)
+	{
+		printf(">>History: %lu lines logged (%lu KiB), %lu lost, %lu joins replayed %lu lines, %lu syncs\n",
+			history.m_appended, (unsigned long)(history.m_bytes / 1024), history.m_lost, history.m_replays, history.m_replayed,
+			history_syncs);
 	}
 }